@@ -3,13 +3,27 @@
  * 9/14/18
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <zlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 int verbose = 0;
 
@@ -20,223 +34,4924 @@ int verbose = 0;
 
 const int line_buffer_length = 1024;
 
+/* A run of positions whose bytes aren't upper-case ACGT, so the 2-bit code
+ * alone can't reproduce them.
+ */
+typedef struct {
+  long start;					/* First position of the run */
+  long length;					/* Number of positions in the run */
+  int symbol;					/* Byte repeated throughout the run, or
+								   SOFT_MASKED for lower-case bases */
+} exception_t;
+
+#define SOFT_MASKED 0
+
+/* One record of the FASTA data: its name from the '>' line (or the file name,
+ * for data with no header) and where its bases sit in the sequence.
+ */
+typedef struct {
+  long name;					/* Offset of the name in the names pool */
+  long start;					/* Offset of the first base in the sequence */
+  long length;					/* Number of bases */
+} contig_t;
+
+/* The records of a sequence, in order. */
+typedef struct {
+  contig_t *entries;
+  long count;
+  long max_count;				/* Allocated length of 'entries' */
+  char *names;					/* NUL-terminated names, end to end */
+  long names_length;
+  long max_names;				/* Allocated length of 'names' */
+} contig_table_t;
+
+typedef struct {
+  char *sequence;				/* Entire sequence */
+  char *seq_ptr;				/* Next location to store data */
+  long max_length;				/* Max length allocated */
+  long cur_length;				/* Current length */
+  unsigned char *packed;		/* 2-bit packed sequence (replaces 'sequence') */
+  exception_t *exceptions;		/* Runs of non-ACGT data in packed sequence */
+  long num_exceptions;
+  contig_table_t contigs;		/* Records the sequence is made of */
+  void *segment;				/* Mapped segment or cache holding the data, or
+								   NULL if it was allocated */
+  long segment_length;
+} fasta_t;
+
+/* Global variables */
+char *pattern = NULL;
+int num_threads = 1;
+long load_bytes = 0;
+long stream_window = 0;
+int pack_sequence = 0;
+char *pattern_file = NULL;
+char *fm_build_file = NULL;
+char *fm_query_file = NULL;
+char *serve_socket = NULL;
+char *client_socket = NULL;
+char *publish_segment = NULL;
+char *attach_segment = NULL;
+char *cache_file = NULL;
+int build_cache = 0;
+int both_strands = 0;
+int iupac = 0;
+int max_edits = 0;
+int hamming = 0;
+int engine = 0;					/* ENGINE_* for single patterns (--engine) */
+char *isa = NULL;				/* Instruction set to cap kernels at (--isa) */
+
+void
+check_thread_rtn(char *msge, int rtn) {
+  if (rtn) {
+    fprintf(stderr, "ERROR: %s (%d)\n", msge,rtn);
+    exit(1);
+  }
+}
+
+/* Start a new contig named by the 'length' bytes at 'name' at offset 'start'
+ * of the sequence. A contig still empty when the next one starts is dropped,
+ * so a file's placeholder contig gives way to its first '>' line.
+ */
+void
+contig_add(contig_table_t *table, const char *name, long length, long start)
+{
+  if (table->count > 0 && table->entries[table->count - 1].start == start) {
+	table->count--;
+  }
+  if (table->count == table->max_count) {
+	table->max_count = table->max_count ? 2 * table->max_count : 64;
+	table->entries = realloc(table->entries, table->max_count * sizeof(contig_t));
+  }
+  while (table->names_length + length + 1 > table->max_names) {
+	table->max_names = table->max_names ? 2 * table->max_names : 4096;
+	table->names = realloc(table->names, table->max_names);
+  }
+  contig_t *contig = &table->entries[table->count++];
+  contig->name = table->names_length;
+  contig->start = start;
+  contig->length = 0;
+  memcpy(table->names + table->names_length, name, length);
+  table->names[table->names_length + length] = '\0';
+  table->names_length += length + 1;
+}
+
+/* Start a new contig for a '>' line, named by its first word. */
+void
+contig_add_header(contig_table_t *table, const char *line, long length, long start)
+{
+  long name_length = 0;
+  while (name_length + 1 < length && !strchr(" \t\r\n", line[name_length + 1])) {
+	name_length++;
+  }
+  contig_add(table, line + 1, name_length, start);
+}
+
+/* Fill in the contigs' lengths, once the sequence is 'end' bytes long. */
+void
+contig_finish(contig_table_t *table, long end)
+{
+  for (long i = 0;  i < table->count;  i++) {
+	long next = i + 1 < table->count ? table->entries[i + 1].start : end;
+	table->entries[i].length = next - table->entries[i].start;
+  }
+}
+
+/* Return the index of the contig holding sequence offset 'offset', by binary
+ * search; -1 if it comes before them all.
+ */
+long
+contig_find(const contig_table_t *table, long offset)
+{
+  long low = 0;
+  long high = table->count;
+  while (low < high) {
+	long mid = (low + high) / 2;
+	if (table->entries[mid].start <= offset) {
+	  low = mid + 1;
+	} else {
+	  high = mid;
+	}
+  }
+  return low - 1;
+}
+
+/* Start 'table' afresh with the contigs of 'from' that reach 'offset' or
+ * beyond, for a window of the sequence that starts at 'offset'.
+ */
+void
+contig_carry(contig_table_t *table, const contig_table_t *from, long offset)
+{
+  table->count = 0;
+  table->names_length = 0;
+  for (long i = 0;  i < from->count;  i++) {
+	const contig_t *contig = &from->entries[i];
+	if (i == from->count - 1 || contig->start + contig->length > offset) {
+	  const char *name = from->names + contig->name;
+	  contig_add(table, name, strlen(name), contig->start);
+	}
+  }
+}
+
+/* Point 'table' at a contig table stored as its entries followed by its
+ * names, say in a mapped file. The table doesn't own that memory.
+ */
+void
+contig_load(contig_table_t *table, const char *stored, long count, long names_length)
+{
+  memset(table, 0, sizeof(*table));
+  table->entries = (contig_t *)stored;
+  table->count = count;
+  table->names = (char *)stored + count * sizeof(contig_t);
+  table->names_length = names_length;
+}
+
+/* Free a contig table built by contig_add(). */
+void
+contig_destroy(contig_table_t *table)
+{
+  free(table->entries);
+  free(table->names);
+  memset(table, 0, sizeof(*table));
+}
+
+/* Create a FASTA object with room for 'max_length' bytes to start with. The
+ * sequence buffer is mapped rather than allocated on the heap, so that
+ * fasta_reserve() and fasta_trim() can resize it with mremap().
+ */
+fasta_t *
+fasta_create(long max_length)
+{
+  if (max_length < ONE_MEGA) {
+	max_length = ONE_MEGA;
+  }
+  if (verbose) {
+	printf("Allocate %ld bytes\n", max_length);
+  }
+  fasta_t *new = malloc(sizeof(fasta_t));
+  new->sequence = mmap(NULL, max_length, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (new->sequence == MAP_FAILED) {
+	fprintf(stderr, "Can't allocate %ld bytes for fasta buffer\n", max_length);
+	exit(1);
+  }
+  new->seq_ptr = new->sequence;
+  new->max_length = max_length;
+  new->cur_length = 0;
+  new->packed = NULL;
+  new->exceptions = NULL;
+  new->num_exceptions = 0;
+  memset(&new->contigs, 0, sizeof(new->contigs));
+  new->segment = NULL;
+  new->segment_length = 0;
+  return new;
+}
+
+/* Destroy a FASTA object; deallocates memory. */
+void
+fasta_destroy(fasta_t *old)
+{
+  if (old->segment) {
+	munmap(old->segment, old->segment_length);
+  } else {
+	if (old->sequence) {
+	  munmap(old->sequence, old->max_length);
+	}
+	free(old->packed);
+	free(old->exceptions);
+	contig_destroy(&old->contigs);
+  }
+  free(old);
+}
+
+/* Resize the sequence buffer of a FASTA structure to 'max_length' bytes. */
+void
+fasta_resize(fasta_t *fasta, long max_length)
+{
+  char *sequence = mremap(fasta->sequence, fasta->max_length, max_length, MREMAP_MAYMOVE);
+  if (sequence == MAP_FAILED) {
+	fprintf(stderr, "Can't resize fasta buffer to %ld bytes\n", max_length);
+	exit(1);
+  }
+  fasta->sequence = sequence;
+  fasta->seq_ptr = sequence + fasta->cur_length;
+  fasta->max_length = max_length;
+}
+
+/* Make room for 'length' more bytes in a FASTA structure. The buffer at
+ * least doubles each time it grows, so a bad first guess at its size costs
+ * only a few remaps; mremap() moves pages rather than copying them.
+ */
+void
+fasta_reserve(fasta_t *fasta, long length)
+{
+  long needed = fasta->cur_length + length;
+  if (needed <= fasta->max_length) {
+	return;
+  }
+  long max_length = 2 * fasta->max_length > needed ? 2 * fasta->max_length : needed;
+  if (verbose) {
+	printf("Grow to %ld bytes\n", max_length);
+  }
+  fasta_resize(fasta, max_length);
+}
+
+/* Shrink the buffer of a fully loaded FASTA structure to its exact length. */
+void
+fasta_trim(fasta_t *fasta)
+{
+  long length = fasta->cur_length > 0 ? fasta->cur_length : 1;
+  if (length < fasta->max_length) {
+	if (verbose) {
+	  printf("Trim to %ld bytes\n", length);
+	}
+	fasta_resize(fasta, length);
+  }
+}
+
+/* Append one line of FASTA data (without its newline) to a FASTA structure,
+ * cratering if it won't fit. The line may overlap the unused tail of the
+ * sequence buffer, which is how inflated BGZF data is compacted in place.
+ */
+void
+fasta_append_line(fasta_t *fasta, const char *line, long length)
+{
+  if (fasta->cur_length + length > fasta->max_length) {
+	fprintf(stderr, "Read %ld bytes; fasta buffer too small (%ld bytes)\n",
+			fasta->cur_length, fasta->max_length);
+	exit(1);
+  }
+  memmove(fasta->seq_ptr, line, length);
+  fasta->seq_ptr += length;
+  fasta->cur_length += length;
+}
+
+/* Append a block of FASTA text to a FASTA structure, skipping annotation
+ * lines and stripping newlines. Walks the text with memchr() to find each line
+ * end and copies whole lines at a time, letting the C library use its
+ * vectorized routines for both.
+ */
+void
+fasta_append_text(fasta_t *fasta, const char *text, long length,
+				  int *lines_kept, int *lines_skipped)
+{
+  const char *line = text;
+  const char *text_end = text + length;
+  while (line < text_end) {
+	const char *eol = memchr(line, '\n', text_end - line);
+	if (eol == NULL) {
+	  eol = text_end;
+	}
+	if (line[0] == '>') {
+	  /* Line contains text annotation; it starts a new contig. */
+	  (*lines_skipped)++;
+	  contig_add_header(&fasta->contigs, line, eol - line, fasta->cur_length);
+	} else {
+	  /* Valid data; copy the whole line at once. */
+	  (*lines_kept)++;
+	  fasta_append_line(fasta, line, eol - line);
+	}
+	line = eol + 1;
+  }
+}
+
+/* Read an uncompressed FASTA file by mapping it into memory rather than
+ * pulling it through a small line buffer.
+ */
+void
+fasta_map_file(char *file_name, fasta_t *fasta)
+{
+  int fd = open(file_name, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+  printf(" LOADING %s\n", file_name);
+
+  int lines_kept = 0;
+  int lines_skipped = 0;
+  if (st.st_size > 0) {
+	const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+	  fprintf(stderr, "Can't map '%s'\n", file_name);
+	  exit(1);
+	}
+	madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+	fasta_reserve(fasta, st.st_size);
+	fasta_append_text(fasta, data, st.st_size, &lines_kept, &lines_skipped);
+	munmap((void *)data, st.st_size);
+  }
+  close(fd);
+  load_bytes += st.st_size;
+
+  if (verbose) {
+	printf("%s: %d lines skipped, %d lines kept, %ld total bytes\n",
+		   file_name, lines_skipped, lines_kept, fasta->cur_length);
+  }
+}
+
+/* One BGZF block: where its deflate data lives in the compressed file and
+ * where its inflated bytes go.
+ */
+typedef struct {
+  const unsigned char *data;	/* Raw deflate data */
+  long data_length;				/* Bytes of deflate data */
+  char *dest;					/* Where to inflate to */
+  long dest_length;				/* Inflated size (ISIZE) */
+  unsigned int crc;				/* Expected CRC-32 of inflated data */
+} bgzf_block_t;
+
+/* Shared state for the BGZF inflate workers. */
+typedef struct {
+  bgzf_block_t *blocks;
+  long num_blocks;
+  long next_block;				/* Next block to hand out */
+  pthread_mutex_t mutex;
+  int failed;					/* Set if any block fails to inflate */
+} bgzf_job_t;
+
+/* Return the BGZF block size (BSIZE + 1) of the gzip member header at 'p',
+ * or 0 if it isn't a BGZF header or the block is too small to hold its own
+ * header and trailer. 'avail' is the number of bytes at 'p'.
+ */
+long
+bgzf_block_size(const unsigned char *p, long avail)
+{
+  if (avail < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) {
+	return 0;
+  }
+  int xlen = p[10] | (p[11] << 8);
+  const unsigned char *field = p + 12;
+  const unsigned char *extra_end = field + xlen;
+  if (12 + xlen > avail) {
+	return 0;
+  }
+  while (field + 4 <= extra_end) {
+	int slen = field[2] | (field[3] << 8);
+	if (field[0] == 'B' && field[1] == 'C' && slen == 2 && field + 6 <= extra_end) {
+	  long block_size = (field[4] | (field[5] << 8)) + 1;
+	  return block_size >= 12 + xlen + 8 ? block_size : 0;
+	}
+	field += 4 + slen;
+  }
+  return 0;
+}
+
+/* Inflate BGZF blocks until there are none left to claim. */
+void *
+bgzf_inflate_worker(void *ptr)
+{
+  bgzf_job_t *job = ptr;
+
+  while (1) {
+	pthread_mutex_lock(&job->mutex);
+	long idx = job->next_block++;
+	pthread_mutex_unlock(&job->mutex);
+	if (idx >= job->num_blocks) {
+	  break;
+	}
+
+	bgzf_block_t *block = &job->blocks[idx];
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, -15) != Z_OK) {
+	  job->failed = 1;
+	  break;
+	}
+	strm.next_in = (unsigned char *)block->data;
+	strm.avail_in = block->data_length;
+	strm.next_out = (unsigned char *)block->dest;
+	strm.avail_out = block->dest_length;
+	int rtn = inflate(&strm, Z_FINISH);
+	inflateEnd(&strm);
+	if (rtn != Z_STREAM_END || strm.total_out != (unsigned long)block->dest_length ||
+		crc32(0, (unsigned char *)block->dest, block->dest_length) != block->crc) {
+	  job->failed = 1;
+	}
+  }
+
+  return (void *)NULL;
+}
+
+/* Read a BGZF-compressed FASTA file (as written by bgzip, samtools, and
+ * htslib). BGZF files are a series of small, independent gzip members whose
+ * headers record their compressed size and whose trailers record their
+ * inflated size, so every block's final position is known before any are
+ * inflated. Blocks are inflated by 'num_threads' workers straight into the
+ * unused tail of the sequence buffer, after which the text is compacted in
+ * place. Returns 0 without reading anything if the file isn't BGZF.
+ */
+int
+fasta_read_bgzf(char *file_name, fasta_t *fasta)
+{
+  int fd = open(file_name, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+  const unsigned char *data = NULL;
+  if (st.st_size > 0) {
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == NULL || data == MAP_FAILED) {
+	return 0;
+  }
+
+  /* Walk the block headers to find every block and its inflated size. */
+  bgzf_job_t job = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0 };
+  long max_blocks = 0;
+  long offset = 0;
+  long text_length = 0;
+  while (offset < st.st_size) {
+	const unsigned char *p = data + offset;
+	long block_size = bgzf_block_size(p, st.st_size - offset);
+	if (block_size < 26 || offset + block_size > st.st_size) {
+	  /* Not BGZF (or truncated); let zlib deal with it. */
+	  free(job.blocks);
+	  munmap((void *)data, st.st_size);
+	  return 0;
+	}
+	if (job.num_blocks == max_blocks) {
+	  max_blocks = max_blocks ? 2 * max_blocks : 1024;
+	  job.blocks = realloc(job.blocks, max_blocks * sizeof(bgzf_block_t));
+	}
+	const unsigned char *trailer = p + block_size - 8;
+	bgzf_block_t *block = &job.blocks[job.num_blocks++];
+	int header_length = 12 + (p[10] | (p[11] << 8));
+	block->data = p + header_length;
+	block->data_length = block_size - header_length - 8;
+	block->dest_length = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) |
+	  ((long)trailer[7] << 24);
+	block->crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+	  ((unsigned int)trailer[3] << 24);
+	text_length += block->dest_length;
+	offset += block_size;
+  }
+
+  printf(" LOADING %s (BGZF, %ld blocks)\n", file_name, job.num_blocks);
+  fasta_reserve(fasta, text_length);
+  char *text = fasta->seq_ptr;
+  for (long b = 0, dest = 0;  b < job.num_blocks;  b++) {
+	job.blocks[b].dest = text + dest;
+	dest += job.blocks[b].dest_length;
+  }
+
+  pthread_t threads[num_threads];
+  for (int i = 0;  i < num_threads;  i++) {
+	check_thread_rtn("create", pthread_create(&threads[i], NULL,
+											  bgzf_inflate_worker, &job));
+  }
+  for (int i = 0;  i < num_threads;  i++) {
+	check_thread_rtn("join", pthread_join(threads[i], NULL));
+  }
+  free(job.blocks);
+  munmap((void *)data, st.st_size);
+  if (job.failed) {
+	fprintf(stderr, "Corrupt BGZF data in '%s'\n", file_name);
+	exit(1);
+  }
+
+  /* Strip annotations and newlines, sliding the text down into place. */
+  int lines_kept = 0;
+  int lines_skipped = 0;
+  fasta_append_text(fasta, text, text_length, &lines_kept, &lines_skipped);
+  load_bytes += text_length;
+
+  if (verbose) {
+	printf("%s: %d lines skipped, %d lines kept, %ld total bytes\n",
+		   file_name, lines_skipped, lines_kept, fasta->cur_length);
+  }
+  return 1;
+}
+
+/* Return true if 'file_name' starts with the gzip magic number. */
+int
+is_gzip_file(char *file_name)
+{
+  unsigned char magic[2] = { 0, 0 };
+  FILE *fp = fopen(file_name, "rb");
+  if (!fp) {
+	return 0;
+  }
+  int got = fread(magic, 1, sizeof(magic), fp);
+  fclose(fp);
+  return got == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/* Guess how many bytes of sequence a FASTA file holds, without reading it:
+ * the size of a flat file, or the inflated size in a gzip file's trailer.
+ * The trailer only covers the last member and wraps at 4 GB, so the guess
+ * can be short, and is 0 for BGZF, whose last block is empty; the loaders
+ * grow the buffer as needed.
+ */
+long
+fasta_size_hint(char *file_name)
+{
+  int fd = open(file_name, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+  unsigned char trailer[4];
+  long hint = st.st_size;
+  if (is_gzip_file(file_name) && st.st_size >= 18 &&
+	  pread(fd, trailer, sizeof(trailer), st.st_size - 4) == sizeof(trailer)) {
+	hint = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((long)trailer[3] << 24);
+  }
+  close(fd);
+  return hint;
+}
+
+/* Read a FASTA file into a FASTA structure. Can be called multiple times and
+ * will append new data to whatever is already in existing structure. For
+ * example, can read multiple chromosome files into a single FASTA
+ * structure. Grows the FASTA structure if the data won't fit. Works with
+ * both .gz and flat text files (but prefer the zipped version to save disk
+ * space!). Flat text files are mapped directly rather than read through
+ * zlib, and BGZF files are inflated in parallel.
+ */
+void
+fasta_read_file(char *file_name, fasta_t *fasta)
+{
+  /* Data before the file's first '>' line belongs to a contig named after
+   * the file.
+   */
+  contig_add(&fasta->contigs, file_name, strlen(file_name), fasta->cur_length);
+
+  if (!is_gzip_file(file_name)) {
+	fasta_map_file(file_name, fasta);
+	return;
+  }
+  if (fasta_read_bgzf(file_name, fasta)) {
+	return;
+  }
+
+  gzFile gzfp = gzopen(file_name, "rb");
+  if (!gzfp) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+  printf(" LOADING %s\n", file_name);
+  
+  /* Reads one line at a time from the FASTA file. */
+  char line_buffer[line_buffer_length];
+  int lines_kept = 0;
+  int lines_skipped = 0;
+  int in_annotation = 0;		/* In the rest of a long '>' line */
+  fasta_reserve(fasta, line_buffer_length);
+  while ((gzgets(gzfp, line_buffer, line_buffer_length) != NULL)) {
+	char *line_ptr = line_buffer;
+	long got = strlen(line_buffer);
+	load_bytes += got;
+	if (in_annotation) {
+	  /* Rest of a '>' line too long for the line buffer. */
+	} else if (line_buffer[0] == '>') {
+	  /* Line contains text annotation; it starts a new contig. */
+	  lines_skipped++;
+	  contig_add_header(&fasta->contigs, line_buffer, got, fasta->cur_length);
+	  in_annotation = 1;
+	} else {
+	  /* Valid data; copy all ACGT data from line buffer. */
+	  lines_kept++;
+	  while (*line_ptr != '\n' && *line_ptr != '\0') {
+		*fasta->seq_ptr++ = *line_ptr++;
+		fasta->cur_length++;
+	  }
+	}
+	if (got > 0 && line_buffer[got - 1] == '\n') {
+	  in_annotation = 0;
+	}
+	fasta_reserve(fasta, line_buffer_length);
+  }
+
+  if (verbose) {
+	printf("%s: %d lines skipped, %d lines kept, %ld total bytes\n",
+		   file_name, lines_skipped, lines_kept, fasta->cur_length);
+  }
+  
+  gzclose(gzfp);
+}
+
+/* A loaded sequence published for other processes on the host to share,
+ * along with the files and contigs it came from. Segments live in POSIX
+ * shared memory, or in a file when the name is a path, so they can be put
+ * on hugetlbfs. The header is written last, so a segment that doesn't start
+ * with SEGMENT_MAGIC is still being published.
+ */
+#define SEGMENT_MAGIC "PSGSEG02"
+
+typedef struct {
+  char magic[8];
+  long length;					/* Bytes of sequence */
+  long num_records;				/* Entries in the record table */
+  long num_contigs;				/* Entries in the contig table */
+  long names_length;			/* Bytes of contig names */
+  long sequence_offset;			/* Where the sequence starts in the segment */
+  unsigned long checksum;		/* CRC-32 of the sequence */
+} segment_header_t;
+
+/* One file's data within the sequence. */
+typedef struct {
+  char name[256];				/* File name, truncated to fit */
+  long start;
+  long length;
+} segment_record_t;
+
+/* Open a segment by name: a path names a file (say on hugetlbfs), anything
+ * else a POSIX shared memory object.
+ */
+int
+segment_open(const char *name, int flags, mode_t mode)
+{
+  if (strchr(name + 1, '/')) {
+	return open(name, flags, mode);
+  }
+  return shm_open(name, flags, mode);
+}
+
+/* CRC-32 of a sequence, in pieces small enough for zlib's crc32(). */
+unsigned long
+sequence_checksum(const char *sequence, long length)
+{
+  unsigned long crc = crc32(0L, Z_NULL, 0);
+  for (long done = 0;  done < length;  done += ONE_GIGA) {
+	long piece = length - done < ONE_GIGA ? length - done : ONE_GIGA;
+	crc = crc32(crc, (const Bytef *)sequence + done, piece);
+  }
+  return crc;
+}
+
+/* Publish the sequence in a FASTA structure as segment 'name', replacing any
+ * segment of that name. Processes already attached to the old one keep it
+ * until they exit.
+ */
+void
+segment_publish(fasta_t *fasta, segment_record_t *records, long num_records, char *name)
+{
+  if (name[0] != '/') {
+	fprintf(stderr, "Segment name '%s' must start with '/'\n", name);
+	exit(1);
+  }
+  if (strchr(name + 1, '/')) {
+	unlink(name);
+  } else {
+	shm_unlink(name);
+  }
+  int fd = segment_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "Can't create segment '%s'\n", name);
+	exit(1);
+  }
+
+  /* Round up to the file system's block size, which on hugetlbfs is the
+   * huge page size it insists on.
+   */
+  const contig_table_t *contigs = &fasta->contigs;
+  long contigs_offset = sizeof(segment_header_t) + num_records * sizeof(segment_record_t);
+  long sequence_offset = contigs_offset + contigs->count * sizeof(contig_t) + contigs->names_length;
+  sequence_offset = (sequence_offset + 4095) & ~4095L;
+  long block = st.st_blksize > 0 ? st.st_blksize : 4096;
+  long segment_length = (sequence_offset + fasta->cur_length + block - 1) / block * block;
+  if (ftruncate(fd, segment_length) < 0) {
+	fprintf(stderr, "Can't size segment '%s' to %ld bytes\n", name, segment_length);
+	exit(1);
+  }
+  char *base = mmap(NULL, segment_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+	fprintf(stderr, "Can't map segment '%s'\n", name);
+	exit(1);
+  }
+  close(fd);
+
+  segment_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.length = fasta->cur_length;
+  header.num_records = num_records;
+  header.num_contigs = contigs->count;
+  header.names_length = contigs->names_length;
+  header.sequence_offset = sequence_offset;
+  header.checksum = sequence_checksum(fasta->sequence, fasta->cur_length);
+  memcpy(base + sizeof(header), records, num_records * sizeof(segment_record_t));
+  memcpy(base + contigs_offset, contigs->entries, contigs->count * sizeof(contig_t));
+  memcpy(base + contigs_offset + contigs->count * sizeof(contig_t), contigs->names,
+		 contigs->names_length);
+  memcpy(base + sequence_offset, fasta->sequence, fasta->cur_length);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+  memcpy(base, &header, sizeof(header));
+  munmap(base, segment_length);
+
+  printf("PUBLISHED %ld bytes to %s\n", fasta->cur_length, name);
+}
+
+/* Attach read-only to the sequence published as segment 'name'. With verbose
+ * output, lists its records and verifies its checksum, which costs a pass
+ * over the sequence.
+ */
+fasta_t *
+segment_attach(char *name)
+{
+  int fd = segment_open(name, O_RDONLY, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "Can't open segment '%s'\n", name);
+	exit(1);
+  }
+  char *base = st.st_size >= (long)sizeof(segment_header_t) ?
+	mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  const segment_header_t *header = (const segment_header_t *)base;
+  if (base == MAP_FAILED || memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) != 0 ||
+	  header->sequence_offset + header->length > st.st_size) {
+	fprintf(stderr, "'%s' is not a complete psg segment\n", name);
+	exit(1);
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  fasta_t *fasta = calloc(1, sizeof(fasta_t));
+  fasta->sequence = base + header->sequence_offset;
+  fasta->seq_ptr = fasta->sequence + header->length;
+  fasta->max_length = fasta->cur_length = header->length;
+  fasta->segment = base;
+  fasta->segment_length = st.st_size;
+  const segment_record_t *records = (const segment_record_t *)(header + 1);
+  contig_load(&fasta->contigs, (const char *)(records + header->num_records),
+			  header->num_contigs, header->names_length);
+  printf("ATTACHED %s (%ld bytes)\n", name, header->length);
+
+  if (verbose) {
+	for (long i = 0;  i < header->num_records;  i++) {
+	  printf("%15ld %15ld %s\n", records[i].start, records[i].length, records[i].name);
+	}
+	if (sequence_checksum(fasta->sequence, fasta->cur_length) != header->checksum) {
+	  fprintf(stderr, "Segment '%s' fails its checksum\n", name);
+	  exit(1);
+	}
+  }
+  return fasta;
+}
+
+/* Bytes of padding after the packed sequence, so that 64-bit loads starting
+ * anywhere in it stay in bounds.
+ */
+#define PACKED_PADDING 8
+
+/* Return the 64 bits of packed data starting at byte 'offset'. */
+uint64_t
+packed_load(const unsigned char *packed, long offset)
+{
+  uint64_t word;
+  memcpy(&word, packed + offset, sizeof(word));
+  return word;
+}
+
+/* Convert a loaded FASTA structure to 2-bit packed form: four bases per byte
+ * (first base in the low bits) with A=0, C=1, G=2, T=3. Anything else --
+ * N's, other IUPAC codes, and soft-masked lower-case bases -- is recorded in
+ * a side list of runs, so the original bytes can always be recovered. The
+ * text sequence is freed, shrinking the sequence to a quarter of its size.
+ */
+void
+fasta_pack(fasta_t *fasta)
+{
+  long length = fasta->cur_length;
+  unsigned char *packed = calloc((length + 3) / 4 + PACKED_PADDING, 1);
+  long max_exceptions = 1024;
+  exception_t *exceptions = malloc(max_exceptions * sizeof(exception_t));
+  long num_exceptions = 0;
+
+  /* Per-byte lookup: 2-bit code and exception symbol (-1 for none). */
+  unsigned char code[256];
+  int symbol[256];
+  for (int c = 0;  c < 256;  c++) {
+	code[c] = 0;
+	symbol[c] = c;
+  }
+  for (int b = 0;  b < 4;  b++) {
+	code[(unsigned char)"ACGT"[b]] = code[(unsigned char)"acgt"[b]] = b;
+	symbol[(unsigned char)"ACGT"[b]] = -1;
+	symbol[(unsigned char)"acgt"[b]] = SOFT_MASKED;
+  }
+
+  const unsigned char *seq = (const unsigned char *)fasta->sequence;
+  for (long i = 0;  i < length;  i++) {
+	packed[i >> 2] |= code[seq[i]] << (2 * (i & 3));
+	int sym = symbol[seq[i]];
+	if (sym < 0) {
+	  continue;
+	}
+	if (num_exceptions > 0 && exceptions[num_exceptions - 1].symbol == sym &&
+		exceptions[num_exceptions - 1].start + exceptions[num_exceptions - 1].length == i) {
+	  exceptions[num_exceptions - 1].length++;
+	  continue;
+	}
+	if (num_exceptions == max_exceptions) {
+	  max_exceptions *= 2;
+	  exceptions = realloc(exceptions, max_exceptions * sizeof(exception_t));
+	}
+	exceptions[num_exceptions].start = i;
+	exceptions[num_exceptions].length = 1;
+	exceptions[num_exceptions].symbol = sym;
+	num_exceptions++;
+  }
+
+  munmap(fasta->sequence, fasta->max_length);
+  fasta->sequence = fasta->seq_ptr = NULL;
+  fasta->packed = packed;
+  fasta->exceptions = realloc(exceptions, (num_exceptions + 1) * sizeof(exception_t));
+  fasta->num_exceptions = num_exceptions;
+
+  if (verbose) {
+	printf("Packed %ld bases into %ld bytes, %ld exception runs\n",
+		   length, (length + 3) / 4, num_exceptions);
+  }
+}
+
+/* Return the index of the first exception run that ends after 'offset'
+ * (num_exceptions if there is none).
+ */
+long
+fasta_first_exception(fasta_t *fasta, long offset)
+{
+  long low = 0;
+  long high = fasta->num_exceptions;
+  while (low < high) {
+	long mid = (low + high) / 2;
+	const exception_t *ex = &fasta->exceptions[mid];
+	if (ex->start + ex->length <= offset) {
+	  low = mid + 1;
+	} else {
+	  high = mid;
+	}
+  }
+  return low;
+}
+
+/* Decode 'length' bytes of a packed sequence starting at 'offset' into
+ * 'buffer', restoring the original text exactly.
+ */
+void
+fasta_unpack(fasta_t *fasta, long offset, long length, char *buffer)
+{
+  for (long i = 0;  i < length;  i++) {
+	long pos = offset + i;
+	buffer[i] = "ACGT"[(fasta->packed[pos >> 2] >> (2 * (pos & 3))) & 3];
+  }
+  for (long e = fasta_first_exception(fasta, offset);  e < fasta->num_exceptions;  e++) {
+	const exception_t *ex = &fasta->exceptions[e];
+	if (ex->start >= offset + length) {
+	  break;
+	}
+	long first = ex->start > offset ? ex->start : offset;
+	long last = ex->start + ex->length < offset + length ?
+	  ex->start + ex->length : offset + length;
+	for (long pos = first;  pos < last;  pos++) {
+	  char *c = &buffer[pos - offset];
+	  *c = ex->symbol == SOFT_MASKED ? *c - 'A' + 'a' : ex->symbol;
+	}
+  }
+}
+
+/* A cache is a binary image of the loaded sequence, text or packed, and its
+ * contig table, laid out so that a later run can map it and search at once
+ * instead of parsing the FASTA files again. It records each source file's
+ * size, modification time and checksum; a cache whose files have changed is
+ * stale and rebuilt. A cache holds one form of the sequence, so a run with
+ * -2 rebuilds a text cache and vice versa; keep one cache file for each form.
+ */
+#define CACHE_MAGIC "PSGCACHE"
+#define CACHE_VERSION 2
+
+typedef struct {
+  char magic[8];
+  int version;
+  int packed;					/* Holds the 2-bit packed sequence */
+  long length;					/* Bases in the sequence */
+  long num_files;
+  long num_exceptions;			/* Entries in the exception table, if packed */
+  long data_offset;				/* Where the sequence (or packed data) starts */
+  long data_length;
+  long exceptions_offset;		/* Where the exception table starts */
+  long num_contigs;				/* Entries in the contig table, which follows */
+  long names_length;			/* Bytes of contig names, which follow that */
+} cache_header_t;
+
+/* One source file: where its data sits in the sequence, and what it looked
+ * like when the cache was built.
+ */
+typedef struct {
+  segment_record_t record;
+  long size;
+  long mtime;
+  unsigned long checksum;		/* CRC-32 of the file's bytes */
+} cache_file_t;
+
+/* Fill in the size, modification time and checksum of a source file. */
+void
+cache_stat_file(const char *file_name, cache_file_t *file, int with_checksum)
+{
+  int fd = open(file_name, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+  file->size = st.st_size;
+  file->mtime = st.st_mtime;
+  file->checksum = 0;
+  if (with_checksum && st.st_size > 0) {
+	const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+	  fprintf(stderr, "Can't map '%s'\n", file_name);
+	  exit(1);
+	}
+	madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+	file->checksum = sequence_checksum(data, st.st_size);
+	munmap((void *)data, st.st_size);
+  }
+  close(fd);
+}
+
+/* Pad an open file with zeros up to a multiple of 4096 bytes. */
+long
+cache_pad(FILE *fp, long offset)
+{
+  static const char zeros[4096];
+  long padded = (offset + 4095) & ~4095L;
+  fwrite(zeros, 1, padded - offset, fp);
+  return padded;
+}
+
+/* Write the loaded sequence in a FASTA structure, and the files it came
+ * from, as cache 'cache_file'. Writes a temporary file and renames it into
+ * place, so a run never maps a half-written cache.
+ */
+void
+cache_write(fasta_t *fasta, segment_record_t *records, int num_files, char *cache_file)
+{
+  char temp_file[strlen(cache_file) + 8];
+  sprintf(temp_file, "%s.tmp", cache_file);
+  FILE *fp = fopen(temp_file, "wb");
+  if (!fp) {
+	fprintf(stderr, "Can't open '%s' for writing\n", temp_file);
+	exit(1);
+  }
+
+  cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.version = CACHE_VERSION;
+  header.packed = fasta->packed != NULL;
+  header.length = fasta->cur_length;
+  header.num_files = num_files;
+  header.num_exceptions = fasta->num_exceptions;
+  header.data_length = fasta->packed ? (fasta->cur_length + 3) / 4 + PACKED_PADDING : fasta->cur_length;
+  header.data_offset = (sizeof(header) + num_files * sizeof(cache_file_t) + 4095) & ~4095L;
+  header.exceptions_offset = (header.data_offset + header.data_length + 4095) & ~4095L;
+  header.num_contigs = fasta->contigs.count;
+  header.names_length = fasta->contigs.names_length;
+
+  fwrite(&header, sizeof(header), 1, fp);
+  for (int i = 0;  i < num_files;  i++) {
+	cache_file_t file;
+	memset(&file, 0, sizeof(file));
+	file.record = records[i];
+	cache_stat_file(records[i].name, &file, 1);
+	fwrite(&file, sizeof(file), 1, fp);
+  }
+  cache_pad(fp, sizeof(header) + num_files * sizeof(cache_file_t));
+  fwrite(fasta->packed ? (const void *)fasta->packed : fasta->sequence, 1, header.data_length, fp);
+  cache_pad(fp, header.data_offset + header.data_length);
+  fwrite(fasta->exceptions, sizeof(exception_t), fasta->num_exceptions, fp);
+  fwrite(fasta->contigs.entries, sizeof(contig_t), fasta->contigs.count, fp);
+  fwrite(fasta->contigs.names, 1, fasta->contigs.names_length, fp);
+
+  if (fclose(fp) != 0 || rename(temp_file, cache_file) != 0) {
+	fprintf(stderr, "Can't write '%s'\n", cache_file);
+	exit(1);
+  }
+  printf("  CACHED %ld bytes into %s\n", fasta->cur_length, cache_file);
+}
+
+/* Check that every table the header of the cache mapped at 'base' describes
+ * lies within its 'size' bytes, and that every offset and name in the tables
+ * does too. Returns 0 if anything doesn't fit.
+ */
+int
+cache_check(const char *base, long size)
+{
+  const cache_header_t *header = (const cache_header_t *)base;
+  const cache_file_t *files = (const cache_file_t *)(header + 1);
+  long data_length = header->packed ? (header->length + 3) / 4 + PACKED_PADDING : header->length;
+  if (header->length < 0 || header->num_files < 0 || header->num_exceptions < 0 ||
+	  header->num_contigs < 0 || header->names_length < 0 ||
+	  header->data_length != data_length ||
+	  header->num_files > (size - (long)sizeof(cache_header_t)) / (long)sizeof(cache_file_t) ||
+	  header->data_offset < (long)sizeof(cache_header_t) +
+	  header->num_files * (long)sizeof(cache_file_t) ||
+	  header->data_offset > size || header->data_length > size - header->data_offset ||
+	  header->exceptions_offset < header->data_offset + header->data_length ||
+	  header->exceptions_offset > size ||
+	  header->num_exceptions > (size - header->exceptions_offset) / (long)sizeof(exception_t)) {
+	return 0;
+  }
+  long contigs_offset = header->exceptions_offset +
+	header->num_exceptions * (long)sizeof(exception_t);
+  if (header->num_contigs > (size - contigs_offset) / (long)sizeof(contig_t)) {
+	return 0;
+  }
+  long names_offset = contigs_offset + header->num_contigs * (long)sizeof(contig_t);
+  if (header->names_length > size - names_offset ||
+	  (header->names_length > 0 && base[names_offset + header->names_length - 1] != '\0')) {
+	return 0;
+  }
+
+  for (long i = 0;  i < header->num_files;  i++) {
+	if (memchr(files[i].record.name, '\0', sizeof(files[i].record.name)) == NULL) {
+	  return 0;
+	}
+  }
+  const exception_t *exceptions = (const exception_t *)(base + header->exceptions_offset);
+  for (long i = 0;  i < header->num_exceptions;  i++) {
+	if (exceptions[i].start < 0 || exceptions[i].length < 0 ||
+		exceptions[i].start > header->length - exceptions[i].length) {
+	  return 0;
+	}
+  }
+  const contig_t *contigs = (const contig_t *)(base + contigs_offset);
+  for (long i = 0;  i < header->num_contigs;  i++) {
+	if (contigs[i].name < 0 || contigs[i].name >= header->names_length ||
+		contigs[i].start < 0 || contigs[i].length < 0 ||
+		contigs[i].start > header->length - contigs[i].length) {
+	  return 0;
+	}
+  }
+  return 1;
+}
+
+/* Map cache 'cache_file' as a FASTA structure, if it was built from exactly
+ * 'file_names' in the requested form. A file whose size matches but whose
+ * modification time doesn't is checksummed, so a copied or touched file
+ * doesn't force a rebuild. With no 'file_names' the cache is taken as it
+ * is, whatever it was built from. Returns NULL if the cache is missing or
+ * stale; otherwise copies the files' records to 'records'.
+ */
+fasta_t *
+cache_attach(char *cache_file, int num_files, char **file_names, int packed,
+			 segment_record_t *records)
+{
+  int fd = open(cache_file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+	if (fd >= 0) {
+	  close(fd);
+	}
+	return NULL;
+  }
+  char *base = st.st_size >= (long)sizeof(cache_header_t) ?
+	mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (base == MAP_FAILED) {
+	return NULL;
+  }
+
+  const cache_header_t *header = (const cache_header_t *)base;
+  const cache_file_t *files = (const cache_file_t *)(header + 1);
+  const char *stale = NULL;
+  if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+	  header->version != CACHE_VERSION) {
+	stale = "not a current psg cache";
+  } else if (!cache_check(base, st.st_size)) {
+	stale = "truncated or corrupt";
+  } else if (header->packed != packed) {
+	stale = packed ? "not packed" : "packed";
+  } else if (num_files > 0 && header->num_files != num_files) {
+	stale = "built from other files";
+  }
+  for (int i = 0;  stale == NULL && i < num_files;  i++) {
+	cache_file_t now_file;
+	if (strncmp(files[i].record.name, file_names[i], sizeof(files[i].record.name) - 1) != 0) {
+	  stale = "built from other files";
+	  break;
+	}
+	cache_stat_file(file_names[i], &now_file, 0);
+	if (now_file.size != files[i].size) {
+	  stale = "older than its files";
+	} else if (now_file.mtime != files[i].mtime) {
+	  cache_stat_file(file_names[i], &now_file, 1);
+	  if (now_file.checksum != files[i].checksum) {
+		stale = "older than its files";
+	  }
+	}
+  }
+  if (stale) {
+	if (verbose) {
+	  printf("Cache '%s' is %s\n", cache_file, stale);
+	}
+	munmap(base, st.st_size);
+	return NULL;
+  }
+
+  fasta_t *fasta = calloc(1, sizeof(fasta_t));
+  fasta->cur_length = fasta->max_length = header->length;
+  if (header->packed) {
+	fasta->packed = (unsigned char *)base + header->data_offset;
+	fasta->exceptions = (exception_t *)(base + header->exceptions_offset);
+	fasta->num_exceptions = header->num_exceptions;
+  } else {
+	fasta->sequence = base + header->data_offset;
+	fasta->seq_ptr = fasta->sequence + header->length;
+  }
+  contig_load(&fasta->contigs, base + header->exceptions_offset +
+			  header->num_exceptions * sizeof(exception_t),
+			  header->num_contigs, header->names_length);
+  fasta->segment = base;
+  fasta->segment_length = st.st_size;
+  printf(" LOADING %s\n", cache_file);
+  for (int i = 0;  i < num_files;  i++) {
+	records[i] = files[i].record;
+  }
+  if (verbose) {
+	for (int i = 0;  i < header->num_files;  i++) {
+	  printf("%15ld %15ld %s\n", files[i].record.start, files[i].record.length,
+			 files[i].record.name);
+	}
+  }
+  return fasta;
+}
+
+/* Return the current time. */
+double
+now(void)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_REALTIME, &current_time);
+  return current_time.tv_sec + (current_time.tv_nsec / ONE_BILLION);
+}
+
+/* A match found by a worker, kept until its job is done and then printed
+ * with the rest of the job's hits in order (see hits_print()).
+ */
+typedef struct {
+  long offset;					/* Offset of the first base in the whole sequence */
+  int length;
+  int pattern;					/* Index into the query's patterns, or 0 */
+  int distance;					/* Edits or mismatches, or -1 for exact */
+} hit_t;
+
+/* A growable list of hits. */
+typedef struct {
+  hit_t *entries;
+  long count;
+  long max_count;				/* Allocated length of 'entries' */
+} hit_list_t;
+
+/* Make room in 'list' for 'n' more hits. */
+void
+hit_list_reserve(hit_list_t *list, long n)
+{
+  while (list->count + n > list->max_count) {
+	list->max_count = list->max_count ? 2 * list->max_count : 1024;
+	list->entries = realloc(list->entries, list->max_count * sizeof(hit_t));
+  }
+}
+
+/* Add a hit of 'length' bytes at sequence offset 'offset' to 'list'. */
+void
+hit_add(hit_list_t *list, long offset, int length, int pattern, int distance)
+{
+  hit_list_reserve(list, 1);
+  hit_t *hit = &list->entries[list->count++];
+  hit->offset = offset;
+  hit->length = length;
+  hit->pattern = pattern;
+  hit->distance = distance;
+}
+
+/* Move the hits in 'from' to the end of 'list', leaving 'from' empty. */
+void
+hit_list_append(hit_list_t *list, hit_list_t *from)
+{
+  hit_list_reserve(list, from->count);
+  memcpy(list->entries + list->count, from->entries, from->count * sizeof(hit_t));
+  list->count += from->count;
+  from->count = 0;
+}
+
+/* Free a hit list's entries. */
+void
+hit_list_destroy(hit_list_t *list)
+{
+  free(list->entries);
+  memset(list, 0, sizeof(*list));
+}
+
+/* Per-worker scratch space handed to match kernels. Owned by a worker thread
+ * and reused from job to job.
+ */
+typedef struct {
+  long trials;					/* Positions tried in the current job */
+  long *pattern_counts;			/* Matches of each pattern in the current job */
+  int max_patterns;				/* Allocated length of 'pattern_counts' */
+  hit_list_t hits;				/* With -v, matches found in the current job */
+} scratch_t;
+
+typedef struct query query_t;
+
+/* A match kernel counts matches of a query starting anywhere in [begin, end)
+ * of the FASTA data, adding each one to 'scratch->hits' if verbose (with
+ * 'base_offset' added to its offset). Adds the positions it tried to
+ * 'scratch->trials'.
+ */
+typedef long (*match_kernel_t)(const query_t *query, fasta_t *fasta, char *begin,
+							   char *end, long base_offset, scratch_t *scratch);
+
+/* Most searches only want counts, so the exact and IUPAC kernels are each
+ * written once, as an inline body taking a constant 'locate' flag, and
+ * compiled twice by KERNEL_VARIANTS(): 'name'_count() only counts, with no
+ * verbose check or other per-match branch, and 'name'_locate() also records
+ * each match for -v. Any attributes the body needs, such as its target, are
+ * passed after the name. KERNEL() picks the variant a query needs.
+ */
+#define KERNEL_VARIANTS(name, ...)										\
+  __VA_ARGS__ long														\
+  name##_count(const query_t *query, fasta_t *fasta, char *begin, char *end, \
+			   long base_offset, scratch_t *scratch)					\
+  {																		\
+	return name(query, fasta, begin, end, base_offset, scratch, 0);		\
+  }																		\
+  __VA_ARGS__ long														\
+  name##_locate(const query_t *query, fasta_t *fasta, char *begin, char *end, \
+				long base_offset, scratch_t *scratch)					\
+  {																		\
+	return name(query, fasta, begin, end, base_offset, scratch, 1);		\
+  }
+
+#define KERNEL(name, locate) ((locate) ? name##_locate : name##_count)
+
+/* CPU features the kernels can use, as found by cpu_detect() at startup and
+ * capped by --isa. Kernels are picked by the features they need rather than
+ * by asking the CPU each time, so --isa can force every path for testing.
+ */
+#define CPU_SSE42 1
+#define CPU_AVX2 2
+#define CPU_AVX512BW 4				/* AVX-512F and BW */
+#define CPU_AVX512VBMI 8
+#define CPU_AVX512VPOPCNTDQ 16
+
+int cpu_features = 0;
+
+/* The instruction sets --isa can cap the kernels at: the features each
+ * allows, and the one the CPU must have for it to make sense.
+ */
+static const struct {
+  const char *name;
+  int allowed;
+  int required;
+} isa_levels[] = {
+  { "scalar", 0, 0 },
+  { "sse4.2", CPU_SSE42, CPU_SSE42 },
+  { "avx2", CPU_SSE42 | CPU_AVX2, CPU_AVX2 },
+  { "avx512", CPU_SSE42 | CPU_AVX2 | CPU_AVX512BW | CPU_AVX512VBMI | CPU_AVX512VPOPCNTDQ,
+	CPU_AVX512BW },
+};
+
+/* Find the features of this CPU that the kernels can use, keeping only
+ * those the instruction set 'isa' allows if it isn't NULL. Exits if 'isa'
+ * is unknown or the CPU can't run it.
+ */
+void
+cpu_detect(const char *isa)
+{
+  int features = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+	features |= CPU_SSE42;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+	features |= CPU_AVX2;
+  }
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+	features |= CPU_AVX512BW;
+	if (__builtin_cpu_supports("avx512vbmi")) {
+	  features |= CPU_AVX512VBMI;
+	}
+	if (__builtin_cpu_supports("avx512vpopcntdq")) {
+	  features |= CPU_AVX512VPOPCNTDQ;
+	}
+  }
+#endif
+  cpu_features = features;
+  if (isa == NULL) {
+	return;
+  }
+  for (size_t i = 0;  i < sizeof(isa_levels) / sizeof(isa_levels[0]);  i++) {
+	if (strcmp(isa, isa_levels[i].name) == 0) {
+	  if ((features & isa_levels[i].required) != isa_levels[i].required) {
+		fprintf(stderr, "This CPU can't run %s kernels\n", isa);
+		exit(1);
+	  }
+	  cpu_features &= isa_levels[i].allowed;
+	  return;
+	}
+  }
+  fprintf(stderr, "Unknown instruction set '%s'\n", isa);
+  exit(1);
+}
+
+typedef struct automaton automaton_t;
+typedef struct myers myers_t;
+typedef struct hamming hamming_t;
+
+/* A kernel for packed data: counts matches starting anywhere in [begin, end)
+ * of a packed FASTA structure, as packed_match_range() does.
+ */
+typedef long (*packed_kernel_t)(const query_t *query, fasta_t *fasta, long begin,
+								long end, scratch_t *scratch);
+
+/* How to search for a query's patterns: the options from the command line
+ * that shape a query, passed to query_create() rather than read from globals
+ * so that each query can have its own.
+ */
+typedef struct {
+  int iupac;					/* Treat IUPAC codes as sets of bases (-i) */
+  int max_edits;				/* Edits allowed in a hit (-k) */
+  int hamming;					/* Allow mismatches only (--hamming) */
+  int engine;					/* ENGINE_* for a single pattern (--engine) */
+  int locate;					/* Record each hit as well as counting (-v) */
+} query_options_t;
+
+/* A compiled search: the pattern(s) to look for and everything precomputed
+ * from them. Read-only once created, so any number of jobs can share it.
+ */
+struct query {
+  const char *pattern;			/* The single pattern, or NULL */
+  char **patterns;				/* Pattern set, when 'pattern' is NULL */
+  int num_patterns;
+  int min_length;				/* Shortest and longest pattern */
+  int max_length;
+  match_kernel_t kernel;		/* Kernel for text sequences */
+  const char *kernel_name;
+  int *bmh_shift;				/* BMH shift table, if using BMH */
+  automaton_t *automaton;		/* Aho-Corasick automaton, for a pattern set */
+  uint64_t *packed_words[4];	/* Pattern packed at each phase, for -2 */
+  uint64_t *packed_masks[4];	/* Bits of each word holding pattern bases */
+  int packed_num_words[4];
+  int packed_plain;				/* Pattern is all upper-case ACGT */
+  unsigned char *iupac_masks;	/* With -i, base set of each pattern position */
+  int iupac_anchors[2];			/* Most selective positions, to filter on */
+  uint64_t *bit_masks;			/* Shift-Or or BNDM mask of each byte value */
+  myers_t *myers;				/* With -k, bit-vectors of each pattern */
+  hamming_t *hamming;			/* With -k --hamming, each pattern's seeds */
+  packed_kernel_t packed_kernel;	/* Kernel for packed data, if not the
+									 * exact one */
+  int max_edits;				/* Edits allowed in a hit, with -k */
+  int iupac;					/* Patterns hold IUPAC codes, with -i */
+  int locate;					/* Record each hit, with -v */
+  int num_forward;				/* With -r, patterns before this index are as
+								 * given and the rest reverse complements;
+								 * 0 if strands aren't reported */
+};
+
+/* The strand to report for a match of pattern 'i' of a query (0 for a single
+ * pattern), or 0 if strands aren't reported.
+ */
+char
+query_strand(const query_t *query, int i)
+{
+  if (query->num_forward == 0) {
+	return 0;
+  }
+  return i < query->num_forward ? '+' : '-';
+}
+
+/* Count matches of the query's pattern starting anywhere in [begin, end) of
+ * the FASTA data with one strncmp() per position, recording each one if
+ * 'locate'. Adds the number of positions tried to 'scratch->trials'.
+ */
+__attribute__((always_inline))
+static inline long
+match_scalar(const query_t *query, fasta_t *fasta, char *begin, char *end,
+			 long base_offset, scratch_t *scratch, const int locate)
+{
+  const char *pattern = query->pattern;
+  int pattern_length = query->max_length;
+  long local_count = 0;
+
+  for (char *cur_location = begin;  cur_location < end;  cur_location++) {
+	int found = strncmp(cur_location, pattern, pattern_length) == 0;
+	if (locate && found) {
+	  hit_add(&scratch->hits, base_offset + (cur_location - fasta->sequence), pattern_length, 0, -1);
+	}
+	local_count += found;
+  }
+  scratch->trials += end - begin;
+  return local_count;
+}
+
+KERNEL_VARIANTS(match_scalar)
+
+#if defined(__x86_64__) || defined(__i386__)
+/* As match_scalar(), but compares each byte of the pattern against 16
+ * positions at a time with SSE and ANDs the results, leaving a lane set for
+ * each position that matches. Counting needs no branch at all: the lanes are
+ * added up in a vector of byte counts, which is folded into two 64-bit
+ * totals before any count can wrap. Only used for patterns of up to
+ * BMH_MIN_LENGTH bytes.
+ */
+__attribute__((target("sse4.2"), always_inline))
+static inline long
+match_sse42(const query_t *query, fasta_t *fasta, char *begin, char *end,
+			long base_offset, scratch_t *scratch, const int locate)
+{
+  const char *pattern = query->pattern;
+  int pattern_length = query->max_length;
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  __m128i bytes[pattern_length];
+  for (int j = 0;  j < pattern_length;  j++) {
+	bytes[j] = _mm_set1_epi8(pattern[j]);
+  }
+  const __m128i zero = _mm_setzero_si128();
+  __m128i counts = zero;
+  __m128i totals = zero;
+  int pending = 0;
+  long local_count = 0;
+  char *cur_location = begin;
+
+  while (cur_location + 16 <= end && cur_location + 16 + pattern_length - 1 <= seq_end) {
+	__m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)cur_location), bytes[0]);
+	for (int j = 1;  j < pattern_length;  j++) {
+	  equal = _mm_and_si128(equal, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(cur_location + j)),
+												  bytes[j]));
+	}
+	if (locate) {
+	  unsigned int mask = _mm_movemask_epi8(equal);
+	  while (mask) {
+		char *candidate = cur_location + __builtin_ctz(mask);
+		hit_add(&scratch->hits, base_offset + (candidate - fasta->sequence), pattern_length, 0, -1);
+		local_count++;
+		mask &= mask - 1;
+	  }
+	} else {
+	  counts = _mm_sub_epi8(counts, equal);
+	  if (++pending == 255) {
+		totals = _mm_add_epi64(totals, _mm_sad_epu8(counts, zero));
+		counts = zero;
+		pending = 0;
+	  }
+	}
+	cur_location += 16;
+  }
+  totals = _mm_add_epi64(totals, _mm_sad_epu8(counts, zero));
+  local_count += _mm_cvtsi128_si64(totals) + _mm_extract_epi64(totals, 1);
+  scratch->trials += cur_location - begin;
+  return local_count + match_scalar(query, fasta, cur_location, end, base_offset, scratch, locate);
+}
+
+KERNEL_VARIANTS(match_sse42, __attribute__((target("sse4.2"))))
+
+/* As match_sse42(), but 64 positions at a time with AVX2, as two vectors
+ * of 32, for a pattern of a fixed 'pattern_length' bytes. Each length gets
+ * its own copy (see FIXED_KERNEL_VARIANTS()), so the compares are unrolled
+ * and the pattern's bytes stay in registers. Beyond the eighth byte, the
+ * remaining compares are skipped once no position in either vector is left.
+ */
+__attribute__((target("avx2"), always_inline))
+static inline long
+match_avx2(const query_t *query, fasta_t *fasta, char *begin, char *end,
+		   long base_offset, scratch_t *scratch, const int locate, const int pattern_length)
+{
+  const char *pattern = query->pattern;
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  __m256i bytes[pattern_length];
+  for (int j = 0;  j < pattern_length;  j++) {
+	bytes[j] = _mm256_set1_epi8(pattern[j]);
+  }
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i counts = zero;
+  __m256i totals = zero;
+  int pending = 0;
+  long local_count = 0;
+  char *cur_location = begin;
+
+  while (cur_location + 64 <= end && cur_location + 64 + pattern_length - 1 <= seq_end) {
+	__m256i equal0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)cur_location), bytes[0]);
+	__m256i equal1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(cur_location + 32)),
+									   bytes[0]);
+	for (int j = 1;  j < pattern_length;  j++) {
+	  if ((j & 7) == 0) {
+		__m256i either = _mm256_or_si256(equal0, equal1);
+		if (_mm256_testz_si256(either, either)) {
+		  break;
+		}
+	  }
+	  equal0 = _mm256_and_si256(equal0,
+								_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(cur_location + j)),
+												  bytes[j]));
+	  equal1 = _mm256_and_si256(equal1,
+								_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(cur_location + 32 + j)),
+												  bytes[j]));
+	}
+	if (locate) {
+	  uint64_t mask = (uint32_t)_mm256_movemask_epi8(equal0) |
+		(uint64_t)(uint32_t)_mm256_movemask_epi8(equal1) << 32;
+	  while (mask) {
+		char *candidate = cur_location + __builtin_ctzll(mask);
+		hit_add(&scratch->hits, base_offset + (candidate - fasta->sequence), pattern_length, 0, -1);
+		local_count++;
+		mask &= mask - 1;
+	  }
+	} else {
+	  counts = _mm256_sub_epi8(_mm256_sub_epi8(counts, equal0), equal1);
+	  if (++pending == 127) {
+		totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counts, zero));
+		counts = zero;
+		pending = 0;
+	  }
+	}
+	cur_location += 64;
+  }
+  totals = _mm256_add_epi64(totals, _mm256_sad_epu8(counts, zero));
+  local_count += _mm256_extract_epi64(totals, 0) + _mm256_extract_epi64(totals, 1) +
+	_mm256_extract_epi64(totals, 2) + _mm256_extract_epi64(totals, 3);
+  scratch->trials += cur_location - begin;
+  return local_count + match_scalar(query, fasta, cur_location, end, base_offset, scratch, locate);
+}
+
+/* Patterns of up to this many bytes have a match_avx2() kernel of their own
+ * length; longer ones use match_bmh().
+ */
+#define FIXED_MAX_LENGTH 32
+
+/* Compile the counting and locating variants of the fixed-length kernel
+ * body 'name' for patterns of length 'n', as 'name'_'n'_count() and
+ * 'name'_'n'_locate(), with the attributes after 'n'.
+ */
+#define FIXED_KERNEL_VARIANTS(name, n, ...)								\
+  __VA_ARGS__ long														\
+  name##_##n##_count(const query_t *query, fasta_t *fasta, char *begin, char *end, \
+					 long base_offset, scratch_t *scratch)				\
+  {																		\
+	return name(query, fasta, begin, end, base_offset, scratch, 0, n);	\
+  }																		\
+  __VA_ARGS__ long														\
+  name##_##n##_locate(const query_t *query, fasta_t *fasta, char *begin, char *end, \
+					  long base_offset, scratch_t *scratch)				\
+  {																		\
+	return name(query, fasta, begin, end, base_offset, scratch, 1, n);	\
+  }
+
+/* An entry of a table of fixed-length kernels by pattern length. */
+#define FIXED_KERNELS(name, n) { name##_##n##_count, name##_##n##_locate }
+
+FIXED_KERNEL_VARIANTS(match_avx2, 1, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 2, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 3, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 4, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 5, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 6, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 7, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 8, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 9, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 10, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 11, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 12, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 13, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 14, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 15, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 16, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 17, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 18, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 19, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 20, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 21, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 22, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 23, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 24, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 25, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 26, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 27, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 28, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 29, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 30, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 31, __attribute__((target("avx2"))))
+FIXED_KERNEL_VARIANTS(match_avx2, 32, __attribute__((target("avx2"))))
+
+/* The match_avx2() kernels by pattern length, counting and locating. */
+static const match_kernel_t match_avx2_fixed[FIXED_MAX_LENGTH + 1][2] = {
+  { NULL, NULL },
+  FIXED_KERNELS(match_avx2, 1), FIXED_KERNELS(match_avx2, 2), FIXED_KERNELS(match_avx2, 3),
+  FIXED_KERNELS(match_avx2, 4), FIXED_KERNELS(match_avx2, 5), FIXED_KERNELS(match_avx2, 6),
+  FIXED_KERNELS(match_avx2, 7), FIXED_KERNELS(match_avx2, 8), FIXED_KERNELS(match_avx2, 9),
+  FIXED_KERNELS(match_avx2, 10), FIXED_KERNELS(match_avx2, 11), FIXED_KERNELS(match_avx2, 12),
+  FIXED_KERNELS(match_avx2, 13), FIXED_KERNELS(match_avx2, 14), FIXED_KERNELS(match_avx2, 15),
+  FIXED_KERNELS(match_avx2, 16), FIXED_KERNELS(match_avx2, 17), FIXED_KERNELS(match_avx2, 18),
+  FIXED_KERNELS(match_avx2, 19), FIXED_KERNELS(match_avx2, 20), FIXED_KERNELS(match_avx2, 21),
+  FIXED_KERNELS(match_avx2, 22), FIXED_KERNELS(match_avx2, 23), FIXED_KERNELS(match_avx2, 24),
+  FIXED_KERNELS(match_avx2, 25), FIXED_KERNELS(match_avx2, 26), FIXED_KERNELS(match_avx2, 27),
+  FIXED_KERNELS(match_avx2, 28), FIXED_KERNELS(match_avx2, 29), FIXED_KERNELS(match_avx2, 30),
+  FIXED_KERNELS(match_avx2, 31), FIXED_KERNELS(match_avx2, 32)
+};
+
+/* Targets for the AVX-512 kernels: every one needs F and BW, and some one
+ * more extension on top, so the base set is spelled out only here.
+ */
+#define AVX512_FEATURES "avx512f,avx512bw,popcnt"
+#define AVX512_TARGET __attribute__((target(AVX512_FEATURES)))
+#define AVX512_VBMI_TARGET __attribute__((target(AVX512_FEATURES ",avx512vbmi")))
+#define AVX512_VPOPCNTDQ_TARGET __attribute__((target(AVX512_FEATURES ",avx512vpopcntdq")))
+
+/* As match_avx2(), but 128 positions at a time with AVX-512BW, as two
+ * vectors of 64. The compares go straight to mask registers, each masked
+ * by the positions still standing, so a vector's matches are counted with
+ * a single popcount.
+ */
+AVX512_TARGET __attribute__((always_inline))
+static inline long
+match_avx512(const query_t *query, fasta_t *fasta, char *begin, char *end,
+			 long base_offset, scratch_t *scratch, const int locate, const int pattern_length)
+{
+  const char *pattern = query->pattern;
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  __m512i bytes[pattern_length];
+  for (int j = 0;  j < pattern_length;  j++) {
+	bytes[j] = _mm512_set1_epi8(pattern[j]);
+  }
+  long local_count = 0;
+  char *cur_location = begin;
+
+  while (cur_location + 128 <= end && cur_location + 128 + pattern_length - 1 <= seq_end) {
+	__mmask64 equal0 = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(cur_location), bytes[0]);
+	__mmask64 equal1 = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(cur_location + 64), bytes[0]);
+	for (int j = 1;  j < pattern_length;  j++) {
+	  if ((j & 7) == 0 && !(equal0 | equal1)) {
+		break;
+	  }
+	  equal0 = _mm512_mask_cmpeq_epi8_mask(equal0, _mm512_loadu_si512(cur_location + j), bytes[j]);
+	  equal1 = _mm512_mask_cmpeq_epi8_mask(equal1, _mm512_loadu_si512(cur_location + 64 + j),
+										   bytes[j]);
+	}
+	if (locate) {
+	  for (int half = 0;  half < 2;  half++) {
+		uint64_t mask = half ? equal1 : equal0;
+		while (mask) {
+		  char *candidate = cur_location + 64 * half + __builtin_ctzll(mask);
+		  hit_add(&scratch->hits, base_offset + (candidate - fasta->sequence), pattern_length, 0, -1);
+		  mask &= mask - 1;
+		}
+	  }
+	}
+	local_count += __builtin_popcountll(equal0) + __builtin_popcountll(equal1);
+	cur_location += 128;
+  }
+  scratch->trials += cur_location - begin;
+  return local_count + match_scalar(query, fasta, cur_location, end, base_offset, scratch, locate);
+}
+
+FIXED_KERNEL_VARIANTS(match_avx512, 1, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 2, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 3, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 4, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 5, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 6, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 7, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 8, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 9, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 10, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 11, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 12, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 13, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 14, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 15, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 16, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 17, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 18, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 19, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 20, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 21, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 22, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 23, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 24, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 25, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 26, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 27, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 28, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 29, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 30, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 31, AVX512_TARGET)
+FIXED_KERNEL_VARIANTS(match_avx512, 32, AVX512_TARGET)
+
+/* The match_avx512() kernels by pattern length, counting and locating. */
+static const match_kernel_t match_avx512_fixed[FIXED_MAX_LENGTH + 1][2] = {
+  { NULL, NULL },
+  FIXED_KERNELS(match_avx512, 1), FIXED_KERNELS(match_avx512, 2), FIXED_KERNELS(match_avx512, 3),
+  FIXED_KERNELS(match_avx512, 4), FIXED_KERNELS(match_avx512, 5), FIXED_KERNELS(match_avx512, 6),
+  FIXED_KERNELS(match_avx512, 7), FIXED_KERNELS(match_avx512, 8), FIXED_KERNELS(match_avx512, 9),
+  FIXED_KERNELS(match_avx512, 10), FIXED_KERNELS(match_avx512, 11), FIXED_KERNELS(match_avx512, 12),
+  FIXED_KERNELS(match_avx512, 13), FIXED_KERNELS(match_avx512, 14), FIXED_KERNELS(match_avx512, 15),
+  FIXED_KERNELS(match_avx512, 16), FIXED_KERNELS(match_avx512, 17), FIXED_KERNELS(match_avx512, 18),
+  FIXED_KERNELS(match_avx512, 19), FIXED_KERNELS(match_avx512, 20), FIXED_KERNELS(match_avx512, 21),
+  FIXED_KERNELS(match_avx512, 22), FIXED_KERNELS(match_avx512, 23), FIXED_KERNELS(match_avx512, 24),
+  FIXED_KERNELS(match_avx512, 25), FIXED_KERNELS(match_avx512, 26), FIXED_KERNELS(match_avx512, 27),
+  FIXED_KERNELS(match_avx512, 28), FIXED_KERNELS(match_avx512, 29), FIXED_KERNELS(match_avx512, 30),
+  FIXED_KERNELS(match_avx512, 31), FIXED_KERNELS(match_avx512, 32)
+};
+#endif
+
+/* Length of the substrings hashed to index the BMH shift table. */
+#define BMH_Q 4
+#define BMH_TABLE_BITS 16
+
+/* Hash the BMH_Q bytes at 'p' into the BMH shift table. */
+uint32_t
+bmh_hash(const char *p)
+{
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return (word * 2654435761u) >> (32 - BMH_TABLE_BITS);
+}
+
+/* Build a BMH shift table for 'pattern'. With a four-letter alphabet a
+ * single byte recurs too often in any pattern to allow long shifts, so the
+ * table is indexed by a hash of the last BMH_Q bytes of the window instead.
+ * Substrings that hash alike share the smaller of their shifts, so
+ * collisions only cost speed, never matches.
+ */
+int *
+bmh_build(const char *pattern)
+{
+  int pattern_length = strlen(pattern);
+  int *bmh_shift = malloc((1 << BMH_TABLE_BITS) * sizeof(int));
+  for (int h = 0;  h < (1 << BMH_TABLE_BITS);  h++) {
+	bmh_shift[h] = pattern_length - BMH_Q + 1;
+  }
+  for (int j = BMH_Q - 1;  j < pattern_length - 1;  j++) {
+	bmh_shift[bmh_hash(pattern + j - BMH_Q + 1)] = pattern_length - 1 - j;
+  }
+  return bmh_shift;
+}
+
+/* Count matches of a long pattern starting anywhere in [begin, end) of the
+ * FASTA data with Boyer-Moore-Horspool, skipping ahead by up to
+ * strlen(pattern) - BMH_Q + 1 positions after each window. Adds the number of
+ * windows actually compared to 'scratch->trials'.
+ */
+__attribute__((always_inline))
+static inline long
+match_bmh(const query_t *query, fasta_t *fasta, char *begin, char *end,
+		  long base_offset, scratch_t *scratch, const int locate)
+{
+  const char *pattern = query->pattern;
+  const int *bmh_shift = query->bmh_shift;
+  int pattern_length = query->max_length;
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  if (end > seq_end - pattern_length + 1) {
+	end = (char *)seq_end - pattern_length + 1;
+  }
+  const char last = pattern[pattern_length - 1];
+  long local_count = 0;
+  long local_trial = 0;
+
+  for (char *cur_location = begin;  cur_location < end;  ) {
+	const char *window_end = cur_location + pattern_length;
+	local_trial++;
+	if (window_end[-1] == last &&
+		memcmp(cur_location, pattern, pattern_length - 1) == 0) {
+	  if (locate) {
+		hit_add(&scratch->hits, base_offset + (cur_location - fasta->sequence), pattern_length, 0, -1);
+	  }
+	  local_count++;
+	}
+	cur_location += bmh_shift[bmh_hash(window_end - BMH_Q)];
+  }
+  scratch->trials += local_trial;
+  return local_count;
+}
+
+KERNEL_VARIANTS(match_bmh)
+
+/* Patterns longer than this use match_bmh(). */
+#define BMH_MIN_LENGTH 16
+
+/* IUPAC matching (-i): each pattern position is the set of bases its IUPAC
+ * code stands for, as a 4-bit mask (A = 1, C = 2, G = 4, T = 8), and each
+ * sequence byte is mapped to the mask of the one base it is. A position
+ * matches when the two masks share a bit, so a degenerate code costs no
+ * more to compare than a plain base. Only upper-case ACGT in the sequence
+ * are bases, so, as with plain patterns, soft-masked (lower-case) sequence
+ * and unknown bases (N) never match. Codes in patterns may be either case.
+ */
+static const char iupac_codes[] = "ACGTRYKMSWBDHVN";
+static const unsigned char iupac_code_masks[] = {
+  1, 2, 4, 8, 1 | 4, 2 | 8, 4 | 8, 1 | 2, 2 | 4, 1 | 8, 2 | 4 | 8, 1 | 4 | 8, 1 | 2 | 8, 1 | 2 | 4, 15
+};
+
+/* Pattern sets are matched by expanding each degenerate pattern into the
+ * plain patterns it stands for; patterns that would expand into more than
+ * this many are refused.
+ */
+#define IUPAC_MAX_VARIANTS 65536
+
+/* The base set mask of the IUPAC code 'c', in either case, or 0 if it isn't
+ * one.
+ */
+int
+iupac_code_mask(char c)
+{
+  if (c >= 'a' && c <= 'z') {
+	c -= 'a' - 'A';
+  }
+  const char *code = strchr(iupac_codes, c);
+  return code && *code ? iupac_code_masks[code - iupac_codes] : 0;
+}
+
+/* The base mask of the sequence byte 'c', or 0 if it isn't a base. */
+int
+iupac_base_mask(char c)
+{
+  switch (c) {
+  case 'A':
+	return 1;
+  case 'C':
+	return 2;
+  case 'G':
+	return 4;
+  case 'T':
+	return 8;
+  default:
+	return 0;
+  }
+}
+
+/* Build the masks of an IUPAC 'pattern', exiting if it has a byte that isn't
+ * an IUPAC code, and pick the two positions with the fewest bases as the
+ * anchors the vector kernels filter on.
+ */
+void
+iupac_build(query_t *query)
+{
+  int pattern_length = query->max_length;
+  query->iupac_masks = malloc(pattern_length + 1);
+  int best[2] = { 5, 5 };
+  for (int j = 0;  j < pattern_length;  j++) {
+	int mask = iupac_code_mask(query->pattern[j]);
+	if (mask == 0) {
+	  fprintf(stderr, "'%c' in pattern '%s' isn't an IUPAC code\n", query->pattern[j], query->pattern);
+	  exit(1);
+	}
+	query->iupac_masks[j] = mask;
+	int bases = __builtin_popcount(mask);
+	if (bases < best[0]) {
+	  best[1] = best[0];
+	  query->iupac_anchors[1] = query->iupac_anchors[0];
+	  best[0] = bases;
+	  query->iupac_anchors[0] = j;
+	} else if (bases <= best[1]) {
+	  best[1] = bases;
+	  query->iupac_anchors[1] = j;
+	}
+  }
+  if (pattern_length == 1) {
+	query->iupac_anchors[1] = 0;
+  }
+}
+
+/* Does the IUPAC query's pattern match at 'p'? */
+int
+iupac_compare(const query_t *query, const char *p)
+{
+  for (int j = 0;  j < query->max_length;  j++) {
+	if (!(iupac_base_mask(p[j]) & query->iupac_masks[j])) {
+	  return 0;
+	}
+  }
+  return 1;
+}
+
+/* Return the plain ACGT patterns an IUPAC 'pattern' stands for, storing how
+ * many in '*num_variants'. Exits if there are more than IUPAC_MAX_VARIANTS.
+ */
+char **
+iupac_expand(const char *pattern, int *num_variants)
+{
+  int length = strlen(pattern);
+  long count = 1;
+  for (int j = 0;  j < length && count <= IUPAC_MAX_VARIANTS;  j++) {
+	int mask = iupac_code_mask(pattern[j]);
+	if (mask == 0) {
+	  fprintf(stderr, "'%c' in pattern '%s' isn't an IUPAC code\n", pattern[j], pattern);
+	  exit(1);
+	}
+	count *= __builtin_popcount(mask);
+  }
+  if (count > IUPAC_MAX_VARIANTS) {
+	fprintf(stderr, "Pattern '%s' stands for more than %d plain patterns\n",
+			pattern, IUPAC_MAX_VARIANTS);
+	exit(1);
+  }
+
+  /* Count through the variants like an odometer, last position fastest. */
+  char **variants = malloc(count * sizeof(char *));
+  for (long v = 0;  v < count;  v++) {
+	variants[v] = malloc(length + 1);
+	long rest = v;
+	for (int j = length - 1;  j >= 0;  j--) {
+	  int mask = iupac_code_mask(pattern[j]);
+	  int choice = rest % __builtin_popcount(mask);
+	  rest /= __builtin_popcount(mask);
+	  int b = 0;
+	  while (!(mask & (1 << b)) || choice-- > 0) {
+		b++;
+	  }
+	  variants[v][j] = "ACGT"[b];
+	}
+	variants[v][length] = '\0';
+  }
+  *num_variants = count;
+  return variants;
+}
+
+/* Count matches of an IUPAC query's pattern starting anywhere in [begin,
+ * end) of the FASTA data, comparing base masks one position at a time.
+ */
+__attribute__((always_inline))
+static inline long
+match_iupac_scalar(const query_t *query, fasta_t *fasta, char *begin, char *end,
+				   long base_offset, scratch_t *scratch, const int locate)
+{
+  int pattern_length = query->max_length;
+  long local_count = 0;
+
+  for (char *cur_location = begin;  cur_location < end;  cur_location++) {
+	int found = iupac_compare(query, cur_location);
+	if (locate && found) {
+	  hit_add(&scratch->hits, base_offset + (cur_location - fasta->sequence), pattern_length, 0, -1);
+	}
+	local_count += found;
+  }
+  scratch->trials += end - begin;
+  return local_count;
+}
+
+KERNEL_VARIANTS(match_iupac_scalar)
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Base masks of 16 sequence bytes with two SSE shuffles: one looks up the
+ * low nibble and one the high, and only the pair that spells A, C, G or T
+ * leaves a bit standing in both.
+ */
+__attribute__((target("sse4.2")))
+__m128i
+iupac_base_masks_sse42(__m128i bytes)
+{
+  const __m128i low_table = _mm_setr_epi8(0, 1, 0, 2, 8, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i high_table = _mm_setr_epi8(0, 0, 0, 0, 7, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i low = _mm_shuffle_epi8(low_table, _mm_and_si128(bytes, nibble));
+  __m128i high = _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+  return _mm_and_si128(low, high);
+}
+
+/* As match_iupac_scalar(), but tests the masks of the query's two anchor
+ * positions against 16 positions at a time with SSE, and only compares the
+ * rest of the pattern at positions where both match.
+ */
+__attribute__((target("sse4.2"), always_inline))
+static inline long
+match_iupac_sse42(const query_t *query, fasta_t *fasta, char *begin, char *end,
+				  long base_offset, scratch_t *scratch, const int locate)
+{
+  int pattern_length = query->max_length;
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  int anchor0 = query->iupac_anchors[0];
+  int anchor1 = query->iupac_anchors[1];
+  const __m128i mask0 = _mm_set1_epi8(query->iupac_masks[anchor0]);
+  const __m128i mask1 = _mm_set1_epi8(query->iupac_masks[anchor1]);
+  const __m128i zero = _mm_setzero_si128();
+  long local_count = 0;
+  char *cur_location = begin;
+
+  while (cur_location + 16 <= end && cur_location + 16 + pattern_length - 1 <= seq_end) {
+	__m128i block0 = iupac_base_masks_sse42(_mm_loadu_si128((const __m128i *)(cur_location + anchor0)));
+	__m128i block1 = iupac_base_masks_sse42(_mm_loadu_si128((const __m128i *)(cur_location + anchor1)));
+	__m128i misses = _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(block0, mask0), zero),
+								  _mm_cmpeq_epi8(_mm_and_si128(block1, mask1), zero));
+	unsigned int mask = ~_mm_movemask_epi8(misses) & 0xffff;
+	while (mask) {
+	  char *candidate = cur_location + __builtin_ctz(mask);
+	  int found = iupac_compare(query, candidate);
+	  if (locate && found) {
+		hit_add(&scratch->hits, base_offset + (candidate - fasta->sequence), pattern_length, 0, -1);
+	  }
+	  local_count += found;
+	  mask &= mask - 1;
+	}
+	cur_location += 16;
+  }
+  scratch->trials += cur_location - begin;
+  return local_count + match_iupac_scalar(query, fasta, cur_location, end, base_offset, scratch,
+										  locate);
+}
+
+KERNEL_VARIANTS(match_iupac_sse42, __attribute__((target("sse4.2"))))
+
+/* As iupac_base_masks_sse42(), but 32 bytes with AVX2. */
+__attribute__((target("avx2")))
+__m256i
+iupac_base_masks_avx2(__m256i bytes)
+{
+  const __m256i low_table = _mm256_setr_epi8(0, 1, 0, 2, 8, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0,
+											 0, 1, 0, 2, 8, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i high_table = _mm256_setr_epi8(0, 0, 0, 0, 7, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+											  0, 0, 0, 0, 7, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(bytes, nibble));
+  __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+  return _mm256_and_si256(low, high);
+}
+
+/* As match_iupac_sse42(), but 32 positions at a time with AVX2. */
+__attribute__((target("avx2"), always_inline))
+static inline long
+match_iupac_avx2(const query_t *query, fasta_t *fasta, char *begin, char *end,
+				 long base_offset, scratch_t *scratch, const int locate)
+{
+  int pattern_length = query->max_length;
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  int anchor0 = query->iupac_anchors[0];
+  int anchor1 = query->iupac_anchors[1];
+  const __m256i mask0 = _mm256_set1_epi8(query->iupac_masks[anchor0]);
+  const __m256i mask1 = _mm256_set1_epi8(query->iupac_masks[anchor1]);
+  const __m256i zero = _mm256_setzero_si256();
+  long local_count = 0;
+  char *cur_location = begin;
+
+  while (cur_location + 32 <= end && cur_location + 32 + pattern_length - 1 <= seq_end) {
+	__m256i block0 = iupac_base_masks_avx2(_mm256_loadu_si256((const __m256i *)(cur_location + anchor0)));
+	__m256i block1 = iupac_base_masks_avx2(_mm256_loadu_si256((const __m256i *)(cur_location + anchor1)));
+	__m256i misses = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_and_si256(block0, mask0), zero),
+									 _mm256_cmpeq_epi8(_mm256_and_si256(block1, mask1), zero));
+	unsigned int mask = ~_mm256_movemask_epi8(misses);
+	while (mask) {
+	  char *candidate = cur_location + __builtin_ctz(mask);
+	  int found = iupac_compare(query, candidate);
+	  if (locate && found) {
+		hit_add(&scratch->hits, base_offset + (candidate - fasta->sequence), pattern_length, 0, -1);
+	  }
+	  local_count += found;
+	  mask &= mask - 1;
+	}
+	cur_location += 32;
+  }
+  scratch->trials += cur_location - begin;
+  return local_count + match_iupac_scalar(query, fasta, cur_location, end, base_offset, scratch,
+										  locate);
+}
+
+KERNEL_VARIANTS(match_iupac_avx2, __attribute__((target("avx2"))))
+
+/* Base masks of 64 sequence bytes with one VBMI byte permute. A, C, G and
+ * T are the only bytes from 0x40 to 0x7f whose low six bits index a mask
+ * in the table, and every byte outside that range is cleared.
+ */
+AVX512_VBMI_TARGET
+__m512i
+iupac_base_masks_avx512(__m512i bytes)
+{
+  static const unsigned char table[64] = {
+	['A' & 63] = 1, ['C' & 63] = 2, ['G' & 63] = 4, ['T' & 63] = 8
+  };
+  __m512i masks = _mm512_permutexvar_epi8(bytes, _mm512_loadu_si512(table));
+  __mmask64 letters = _mm512_cmpeq_epi8_mask(_mm512_and_si512(bytes, _mm512_set1_epi8(0xc0)),
+											 _mm512_set1_epi8(0x40));
+  return _mm512_maskz_mov_epi8(letters, masks);
+}
+
+/* As match_iupac_avx2(), but 64 positions at a time with AVX-512. */
+AVX512_VBMI_TARGET __attribute__((always_inline))
+static inline long
+match_iupac_avx512(const query_t *query, fasta_t *fasta, char *begin, char *end,
+				   long base_offset, scratch_t *scratch, const int locate)
+{
+  int pattern_length = query->max_length;
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  int anchor0 = query->iupac_anchors[0];
+  int anchor1 = query->iupac_anchors[1];
+  const __m512i mask0 = _mm512_set1_epi8(query->iupac_masks[anchor0]);
+  const __m512i mask1 = _mm512_set1_epi8(query->iupac_masks[anchor1]);
+  long local_count = 0;
+  char *cur_location = begin;
+
+  while (cur_location + 64 <= end && cur_location + 64 + pattern_length - 1 <= seq_end) {
+	__m512i block0 = iupac_base_masks_avx512(_mm512_loadu_si512(cur_location + anchor0));
+	__m512i block1 = iupac_base_masks_avx512(_mm512_loadu_si512(cur_location + anchor1));
+	uint64_t mask = _mm512_mask_test_epi8_mask(_mm512_test_epi8_mask(block0, mask0), block1, mask1);
+	while (mask) {
+	  char *candidate = cur_location + __builtin_ctzll(mask);
+	  int found = iupac_compare(query, candidate);
+	  if (locate && found) {
+		hit_add(&scratch->hits, base_offset + (candidate - fasta->sequence), pattern_length, 0, -1);
+	  }
+	  local_count += found;
+	  mask &= mask - 1;
+	}
+	cur_location += 64;
+  }
+  scratch->trials += cur_location - begin;
+  return local_count + match_iupac_scalar(query, fasta, cur_location, end, base_offset, scratch,
+										  locate);
+}
+
+KERNEL_VARIANTS(match_iupac_avx512, AVX512_VBMI_TARGET)
+#endif
+
+/* Bit-parallel matching (--engine): each position of a pattern of up to
+ * BIT_PARALLEL_MAX_LENGTH bases is a bit of a 64-bit word, and each byte
+ * value has a mask of the positions it matches (with -i, those whose base
+ * set holds it), so every partial match is advanced at once.
+ *
+ * Shift-Or keeps a word with a clear bit for each pattern prefix that ends
+ * at the current base, and advances it with one table lookup, shift and OR
+ * per base. BNDM reads a window of pattern length backwards, ANDing the
+ * masks of the reversed pattern, until no substring of the pattern is left,
+ * then slides the window up to the last pattern prefix it saw, so it skips
+ * most bases where matches are rare.
+ *
+ * For plain patterns the vector kernels and BMH beat both at every length.
+ * IUPAC patterns are another matter: the anchors of the IUPAC kernels filter
+ * poorly when degenerate codes abound, and the cost of a bit-parallel scan
+ * doesn't depend on the codes at all. So by default (ENGINE_AUTO) IUPAC
+ * patterns that fit a word use BNDM from BNDM_MIN_LENGTH bases up, where its
+ * windows skip far enough to pay for reading them backwards, and Shift-Or
+ * below that.
+ */
+#define BIT_PARALLEL_MAX_LENGTH 64
+#define BNDM_MIN_LENGTH 24
+
+/* Engines for a single pattern (--engine). */
+#define ENGINE_AUTO 0
+#define ENGINE_SHIFT_OR 1
+#define ENGINE_BNDM 2
+
+/* Build the query's per-byte masks for Shift-Or, or for BNDM if
+ * 'reversed', with the bit for pattern position j at bit j (m - 1 - j when
+ * reversed). Shift-Or masks have the bits of the matching positions clear,
+ * BNDM masks have them set.
+ */
+void
+bit_masks_build(query_t *query, int reversed)
+{
+  int pattern_length = query->max_length;
+  query->bit_masks = malloc(256 * sizeof(uint64_t));
+  for (int c = 0;  c < 256;  c++) {
+	uint64_t mask = 0;
+	for (int j = 0;  j < pattern_length;  j++) {
+	  int matches = query->iupac_masks ?
+		(iupac_base_mask(c) & query->iupac_masks[j]) != 0 : c == (unsigned char)query->pattern[j];
+	  if (matches) {
+		mask |= (uint64_t)1 << (reversed ? pattern_length - 1 - j : j);
+	  }
+	}
+	query->bit_masks[c] = reversed ? mask : ~mask;
+  }
+}
+
+/* Count matches of the query's pattern starting anywhere in [begin, end) of
+ * the FASTA data with Shift-Or, scanning on to the end of the last start's
+ * window. A match needs a full pattern's worth of bases since 'begin', so
+ * none can start before it.
+ */
+__attribute__((always_inline))
+static inline long
+match_shift_or(const query_t *query, fasta_t *fasta, char *begin, char *end,
+			   long base_offset, scratch_t *scratch, const int locate)
+{
+  int pattern_length = query->max_length;
+  const uint64_t *masks = query->bit_masks;
+  const uint64_t high_bit = (uint64_t)1 << (pattern_length - 1);
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  const char *scan_end = end + pattern_length - 1 < seq_end ? end + pattern_length - 1 : seq_end;
+  uint64_t state = ~(uint64_t)0;
+  long local_count = 0;
+
+  for (const char *p = begin;  p < scan_end;  p++) {
+	state = (state << 1) | masks[(unsigned char)*p];
+	if (locate && !(state & high_bit)) {
+	  hit_add(&scratch->hits, base_offset + (p - pattern_length + 1 - fasta->sequence),
+			  pattern_length, 0, -1);
+	}
+	local_count += !(state & high_bit);
+  }
+  scratch->trials += end - begin;
+  return local_count;
+}
+
+KERNEL_VARIANTS(match_shift_or)
+
+/* Count matches of the query's pattern starting anywhere in [begin, end) of
+ * the FASTA data with BNDM. Adds the number of windows read to
+ * 'scratch->trials'.
+ */
+__attribute__((always_inline))
+static inline long
+match_bndm(const query_t *query, fasta_t *fasta, char *begin, char *end,
+		   long base_offset, scratch_t *scratch, const int locate)
+{
+  int pattern_length = query->max_length;
+  const uint64_t *masks = query->bit_masks;
+  const uint64_t high_bit = (uint64_t)1 << (pattern_length - 1);
+  const uint64_t all = ~(uint64_t)0 >> (64 - pattern_length);
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  if (end > seq_end - pattern_length + 1) {
+	end = (char *)seq_end - pattern_length + 1;
+  }
+  long local_count = 0;
+  long local_trial = 0;
+
+  for (char *window = begin;  window < end;  ) {
+	int j = pattern_length;
+	int shift = pattern_length;
+	uint64_t state = all;
+	local_trial++;
+	while (state) {
+	  state &= masks[(unsigned char)window[--j]];
+	  if (state & high_bit) {
+		if (j == 0) {
+		  if (locate) {
+			hit_add(&scratch->hits, base_offset + (window - fasta->sequence), pattern_length, 0, -1);
+		  }
+		  local_count++;
+		  break;
+		}
+		shift = j;
+	  }
+	  state <<= 1;
+	}
+	window += shift;
+  }
+  scratch->trials += local_trial;
+  return local_count;
+}
+
+KERNEL_VARIANTS(match_bndm)
+
+/* Approximate matching (-k): hits within 'max_edits' mismatches, insertions
+ * and deletions of a pattern, found with Myers' bit-vector algorithm. The
+ * edit distance column for each text position is kept as bit-vectors of its
+ * vertical deltas, one bit per pattern base, so advancing a column costs a
+ * handful of word operations per 64 bases. Longer patterns use several
+ * words, and only the words from the top down to the last that can still
+ * hold a distance within 'max_edits' are advanced (Myers' banding), so a long
+ * pattern costs about as much as a short one away from hits.
+ *
+ * The positions where a pattern ends within 'max_edits' come in runs around
+ * each hit; a run is reported once, at its best end, with its distance.
+ * Jobs search by end position rather than start: a run belongs to the block
+ * it starts in, and a block scans on past its end to finish its last run.
+ * A block first warms up on the bases before it, so its distances are exact
+ * and it can tell a run carried over from the block before.
+ */
+struct myers {
+  int length;					/* Pattern length */
+  int num_blocks;				/* 64-bit words per bit-vector */
+  uint64_t high_bit;			/* Last pattern base's bit in the last word */
+  uint64_t *peq;				/* Bases matching each byte, 256 x num_blocks */
+  uint64_t *reverse_peq;		/* The same for the reversed pattern */
+};
+
+/* Does the sequence byte 'c' match pattern byte 'p'? With 'iupac', 'p' is
+ * an IUPAC code.
+ */
+int
+myers_matches(char c, char p, int iupac)
+{
+  if (iupac) {
+	return (iupac_base_mask(c) & iupac_code_mask(p)) != 0;
+  }
+  return c == p;
+}
+
+/* Build the match vectors of 'pattern', forwards and reversed. */
+void
+myers_build(myers_t *my, const char *pattern, int iupac)
+{
+  int length = strlen(pattern);
+  my->length = length;
+  my->num_blocks = (length + 63) / 64;
+  my->high_bit = (uint64_t)1 << ((length - 1) % 64);
+  my->peq = calloc(256 * my->num_blocks, sizeof(uint64_t));
+  my->reverse_peq = calloc(256 * my->num_blocks, sizeof(uint64_t));
+  for (int c = 0;  c < 256;  c++) {
+	for (int j = 0;  j < length;  j++) {
+	  if (myers_matches(c, pattern[j], iupac)) {
+		my->peq[c * my->num_blocks + j / 64] |= (uint64_t)1 << (j % 64);
+	  }
+	  if (myers_matches(c, pattern[length - 1 - j], iupac)) {
+		my->reverse_peq[c * my->num_blocks + j / 64] |= (uint64_t)1 << (j % 64);
+	  }
+	}
+  }
+}
+
+/* Advance one word of a distance column by one text byte with match vector
+ * 'eq'. 'carry' is the change in distance along the word's top edge (-1, 0
+ * or +1); returns the change along its bottom edge, at 'high_bit'.
+ */
+int
+myers_advance(uint64_t *pv, uint64_t *mv, uint64_t eq, int carry, uint64_t high_bit)
+{
+  uint64_t xv = eq | *mv;
+  if (carry < 0) {
+	eq |= 1;
+  }
+  uint64_t xh = (((eq & *pv) + *pv) ^ *pv) | eq;
+  uint64_t ph = *mv | ~(xh | *pv);
+  uint64_t mh = *pv & xh;
+  int out = ((ph & high_bit) != 0) - ((mh & high_bit) != 0);
+  ph <<= 1;
+  mh <<= 1;
+  if (carry < 0) {
+	mh |= 1;
+  } else if (carry > 0) {
+	ph |= 1;
+  }
+  *pv = mh | ~(xv | ph);
+  *mv = ph & xv;
+  return out;
+}
+
+/* Return where a hit of pattern 'i' with 'distance' edits ending at
+ * 'best_end' starts, by aligning the reversed pattern backwards from there.
+ * 'first' is the first offset the hit could start at.
+ */
+long
+myers_start(const query_t *query, int i, fasta_t *fasta, long first, long best_end,
+			int distance)
+{
+  const myers_t *my = &query->myers[i];
+  int num_blocks = my->num_blocks;
+  uint64_t pv[num_blocks];
+  uint64_t mv[num_blocks];
+  for (int b = 0;  b < num_blocks;  b++) {
+	pv[b] = ~(uint64_t)0;
+	mv[b] = 0;
+  }
+  long start = best_end - my->length + 1;
+  int score = my->length;
+  for (long p = best_end;  p >= first && p > best_end - my->length - query->max_edits;  p--) {
+	const uint64_t *eq = my->reverse_peq + (unsigned char)fasta->sequence[p] * num_blocks;
+	int carry = 1;
+	for (int b = 0;  b < num_blocks;  b++) {
+	  carry = myers_advance(&pv[b], &mv[b], eq[b], carry,
+							b == num_blocks - 1 ? my->high_bit : (uint64_t)1 << 63);
+	}
+	score += carry;
+	if (score <= distance) {
+	  start = p;
+	  break;
+	}
+  }
+  return start < first ? first : start;
+}
+
+/* Record a hit of pattern 'i' with 'distance' edits ending at 'best_end'. */
+void
+myers_report(const query_t *query, int i, fasta_t *fasta, long first, long best_end,
+			 int distance, long base_offset, scratch_t *scratch)
+{
+  long start = myers_start(query, i, fasta, first, best_end, distance);
+  hit_add(&scratch->hits, base_offset + start, best_end - start + 1, i, distance);
+}
+
+/* Count the hits of pattern 'i' of a -k query whose runs start at an end
+ * position in [begin, end) of the FASTA data, warming up from no earlier
+ * than 'first', where the contig starts.
+ */
+long
+myers_scan(const query_t *query, int i, fasta_t *fasta, long first, long begin, long end,
+		   long base_offset, scratch_t *scratch)
+{
+  const myers_t *my = &query->myers[i];
+  int k = query->max_edits;
+  int num_blocks = my->num_blocks;
+  int last = num_blocks - 1;
+  uint64_t pv[num_blocks];
+  uint64_t mv[num_blocks];
+  int score[num_blocks];
+  for (int b = 0;  b < num_blocks;  b++) {
+	pv[b] = ~(uint64_t)0;
+	mv[b] = 0;
+	score[b] = b == last ? my->length : 64 * (b + 1);
+  }
+  int y = (k - 1) / 64;
+
+  long local_count = 0;
+  int in_run = 0;
+  int owned = 0;
+  int best = 0;
+  long best_end = 0;
+  const unsigned char *sequence = (const unsigned char *)fasta->sequence;
+  const uint64_t *peq = my->peq;
+  const uint64_t high_bit = my->high_bit;
+  long length = fasta->cur_length;
+  long p = begin - my->length - k > first ? begin - my->length - k : first;
+  for ( ;  p < length;  p++) {
+	const uint64_t *eq = peq + sequence[p] * num_blocks;
+	int distance;
+	if (num_blocks == 1) {
+	  distance = score[0] += myers_advance(&pv[0], &mv[0], eq[0], 0, high_bit);
+	} else {
+	  int carry = 0;
+	  for (int b = 0;  b <= y;  b++) {
+		carry = myers_advance(&pv[b], &mv[b], eq[b], carry,
+							  b == last ? high_bit : (uint64_t)1 << 63);
+		score[b] += carry;
+	  }
+	  if (y < last && score[y] - carry <= k && ((eq[y + 1] & 1) || carry < 0)) {
+		y++;
+		pv[y] = ~(uint64_t)0;
+		mv[y] = 0;
+		int rows = y == last ? my->length - 64 * y : 64;
+		score[y] = score[y - 1] - carry + rows +
+		  myers_advance(&pv[y], &mv[y], eq[y], carry, y == last ? high_bit : (uint64_t)1 << 63);
+	  } else {
+		while (y > 0 && score[y] >= k + 64) {
+		  y--;
+		}
+	  }
+	  distance = y == last ? score[last] : k + 1;
+	}
+
+	if (distance <= k) {
+	  if (!in_run) {
+		in_run = 1;
+		owned = p >= begin;
+		best = distance;
+		best_end = p;
+	  } else if (distance < best) {
+		best = distance;
+		best_end = p;
+	  }
+	} else if (in_run) {
+	  in_run = 0;
+	  if (owned) {
+		if (query->locate) {
+		  myers_report(query, i, fasta, first, best_end, best, base_offset, scratch);
+		}
+		local_count++;
+	  }
+	}
+	if (p >= end - 1 && !in_run) {
+	  break;
+	}
+  }
+  if (in_run && owned) {
+	if (query->locate) {
+	  myers_report(query, i, fasta, first, best_end, best, base_offset, scratch);
+	}
+	local_count++;
+  }
+  return local_count;
+}
+
+/* Count the hits of each of a -k query's patterns whose runs start at an end
+ * position in [begin, end) of the FASTA data, one pattern after another over
+ * the same cache-sized block. Adds the number of end positions tried to
+ * 'scratch->trials'.
+ */
+long
+match_myers(const query_t *query, fasta_t *fasta, char *begin, char *end,
+			long base_offset, scratch_t *scratch)
+{
+  /* No hit can start before its contig does. */
+  long c = contig_find(&fasta->contigs, base_offset + (begin - fasta->sequence));
+  long first = 0;
+  if (c >= 0 && fasta->contigs.entries[c].start - base_offset > 0) {
+	first = fasta->contigs.entries[c].start - base_offset;
+  }
+  int num_patterns = query->patterns ? query->num_patterns : 1;
+  long local_count = 0;
+  for (int i = 0;  i < num_patterns;  i++) {
+	long count = myers_scan(query, i, fasta, first, begin - fasta->sequence,
+							end - fasta->sequence, base_offset, scratch);
+	if (query->patterns) {
+	  scratch->pattern_counts[i] += count;
+	}
+	local_count += count;
+  }
+  scratch->trials += (end - begin) * num_patterns;
+  return local_count;
+}
+
+/* Aho-Corasick automaton for matching a whole set of patterns in one pass.
+ * The automaton is a complete DFA: every state has a transition for every
+ * symbol, so scanning costs one table lookup per base. Bytes are first mapped
+ * to a compact alphabet of just the bytes that occur in the patterns (plus
+ * one symbol for everything else), which for DNA keeps each state's row to a
+ * handful of entries. Transitions hold the target's row offset shifted left
+ * one bit, with the low bit set if any pattern ends at the target.
+ */
+struct automaton {
+  unsigned char symbol[256];	/* Compact symbol for each byte */
+  int alphabet_size;
+  int num_states;
+  int32_t *next;				/* num_states x alphabet_size transitions */
+  int32_t *first_match;			/* First text ending at each state, or -1 */
+  int32_t *match_link;			/* Nearest suffix state with a match, or 0 */
+  int32_t *next_match;			/* Next text with the same text, or -1 */
+  int *owner;					/* Pattern each text stands for */
+  int *length;					/* Length of each text */
+};
+
+/* Build the Aho-Corasick automaton for a set of patterns. The automaton
+ * matches texts: the patterns themselves, or with 'iupac' the plain patterns
+ * each IUPAC pattern stands for, mapped back to it by 'owner'.
+ */
+automaton_t *
+automaton_create(char **patterns, int num_patterns, int iupac)
+{
+  automaton_t *ac = malloc(sizeof(automaton_t));
+  char **texts = patterns;
+  int num_texts = num_patterns;
+  ac->owner = malloc(num_patterns * sizeof(int));
+  for (int i = 0;  i < num_patterns;  i++) {
+	ac->owner[i] = i;
+  }
+  if (iupac) {
+	texts = NULL;
+	num_texts = 0;
+	for (int i = 0;  i < num_patterns;  i++) {
+	  int num_variants;
+	  char **variants = iupac_expand(patterns[i], &num_variants);
+	  texts = realloc(texts, (num_texts + num_variants) * sizeof(char *));
+	  ac->owner = realloc(ac->owner, (num_texts + num_variants) * sizeof(int));
+	  for (int v = 0;  v < num_variants;  v++) {
+		ac->owner[num_texts] = i;
+		texts[num_texts++] = variants[v];
+	  }
+	  free(variants);
+	}
+  }
+
+  memset(ac->symbol, 0, sizeof(ac->symbol));
+  ac->alphabet_size = 1;
+  ac->length = malloc(num_texts * sizeof(int));
+  long total_length = 0;
+  for (int i = 0;  i < num_texts;  i++) {
+	for (const char *c = texts[i];  *c;  c++) {
+	  if (ac->symbol[(unsigned char)*c] == 0) {
+		ac->symbol[(unsigned char)*c] = ac->alphabet_size++;
+	  }
+	}
+	ac->length[i] = strlen(texts[i]);
+	total_length += ac->length[i];
+  }
+
+  /* Build the trie; -1 marks a missing edge. */
+  int size = ac->alphabet_size;
+  long max_states = total_length + 1;
+  int32_t *next = malloc(max_states * size * sizeof(int32_t));
+  int32_t *first_match = malloc(max_states * sizeof(int32_t));
+  int32_t *match_link = calloc(max_states, sizeof(int32_t));
+  int32_t *fail = calloc(max_states, sizeof(int32_t));
+  ac->next_match = malloc(num_texts * sizeof(int32_t));
+  for (int a = 0;  a < size;  a++) {
+	next[a] = -1;
+  }
+  first_match[0] = -1;
+  int num_states = 1;
+  for (int i = 0;  i < num_texts;  i++) {
+	int state = 0;
+	for (const char *c = texts[i];  *c;  c++) {
+	  int32_t *edge = &next[state * size + ac->symbol[(unsigned char)*c]];
+	  if (*edge < 0) {
+		for (int a = 0;  a < size;  a++) {
+		  next[num_states * size + a] = -1;
+		}
+		first_match[num_states] = -1;
+		*edge = num_states++;
+	  }
+	  state = *edge;
+	}
+	ac->next_match[i] = first_match[state];
+	first_match[state] = i;
+  }
+
+  /* Fill in failure transitions breadth-first, so each state's failure
+   * target is already complete when the state is reached.
+   */
+  int32_t *queue = malloc(num_states * sizeof(int32_t));
+  int head = 0;
+  int tail = 0;
+  for (int a = 0;  a < size;  a++) {
+	if (next[a] < 0) {
+	  next[a] = 0;
+	} else {
+	  queue[tail++] = next[a];
+	}
+  }
+  while (head < tail) {
+	int state = queue[head++];
+	for (int a = 0;  a < size;  a++) {
+	  int32_t *edge = &next[state * size + a];
+	  int32_t fallback = next[fail[state] * size + a];
+	  if (*edge < 0) {
+		*edge = fallback;
+	  } else {
+		fail[*edge] = fallback;
+		match_link[*edge] = first_match[fallback] >= 0 ? fallback : match_link[fallback];
+		queue[tail++] = *edge;
+	  }
+	}
+  }
+  free(queue);
+  free(fail);
+  if (texts != patterns) {
+	for (int i = 0;  i < num_texts;  i++) {
+	  free(texts[i]);
+	}
+	free(texts);
+  }
+
+  /* Convert targets to flagged row offsets. */
+  for (long t = 0;  t < (long)num_states * size;  t++) {
+	int target = next[t];
+	int has_match = first_match[target] >= 0 || match_link[target] != 0;
+	next[t] = (target * size) << 1 | has_match;
+  }
+
+  ac->num_states = num_states;
+  ac->next = realloc(next, (long)num_states * size * sizeof(int32_t));
+  ac->first_match = realloc(first_match, num_states * sizeof(int32_t));
+  ac->match_link = realloc(match_link, num_states * sizeof(int32_t));
+  if (verbose) {
+	printf("Aho-Corasick automaton: %d states, %d symbols, %ld bytes\n",
+		   num_states, size, (long)num_states * size * sizeof(int32_t));
+  }
+  return ac;
+}
+
+/* Destroy an Aho-Corasick automaton. */
+void
+automaton_destroy(automaton_t *ac)
+{
+  free(ac->next);
+  free(ac->first_match);
+  free(ac->match_link);
+  free(ac->next_match);
+  free(ac->owner);
+  free(ac->length);
+  free(ac);
+}
+
+/* Count matches of all of the query's patterns starting anywhere in
+ * [begin, end) of the FASTA data in a single pass with the Aho-Corasick
+ * automaton, adding each pattern's matches to 'scratch->pattern_counts'.
+ * Returns the total number of matches and adds the number of positions tried
+ * to 'scratch->trials'.
+ */
+__attribute__((always_inline))
+static inline long
+match_ac(const query_t *query, fasta_t *fasta, char *begin, char *end,
+		 long base_offset, scratch_t *scratch, const int locate)
+{
+  const automaton_t *ac = query->automaton;
+  const int32_t *next = ac->next;
+  const unsigned char *symbol = ac->symbol;
+  int size = ac->alphabet_size;
+  const char *seq_end = fasta->sequence + fasta->cur_length;
+  const char *scan_end = end + query->max_length - 1 < seq_end ?
+	end + query->max_length - 1 : seq_end;
+  long *local_counts = scratch->pattern_counts;
+  long local_count = 0;
+
+  int32_t state = 0;
+  for (const char *p = begin;  p < scan_end;  p++) {
+	state = next[(state >> 1) + symbol[(unsigned char)*p]];
+	if (!(state & 1)) {
+	  continue;
+	}
+	/* Walk every pattern that ends here. */
+	for (int s = (state >> 1) / size;  s != 0;  s = ac->match_link[s]) {
+	  for (int t = ac->first_match[s];  t >= 0;  t = ac->next_match[t]) {
+		int i = ac->owner[t];
+		int length = ac->length[t];
+		char *start = (char *)p - length + 1;
+		if (start >= end) {
+		  continue;
+		}
+		if (locate) {
+		  hit_add(&scratch->hits, base_offset + (start - fasta->sequence), length, i, -1);
+		}
+		local_counts[i]++;
+		local_count++;
+	  }
+	}
+  }
+
+  scratch->trials += end - begin;
+  return local_count;
+}
+
+KERNEL_VARIANTS(match_ac)
+
+/* Hamming matching (-k with --hamming): hits with at most 'max_edits'
+ * substitutions and no insertions or deletions, for screening that only
+ * needs to tolerate SNPs. Jobs search by start position, as for exact
+ * matching.
+ *
+ * On text, each start's mismatches are counted directly, 32 starts at a
+ * time: the pattern's bytes are compared one by one against 32 consecutive
+ * sequence bytes, adding up mismatches per start in a vector, until every
+ * start in the vector has more than 'max_edits'. Where that can't be used
+ * (no AVX2, or a pattern over 255 bases) and the pattern splits into
+ * max_edits + 1 seeds of at least HAMMING_MIN_SEED bases, a pigeonhole
+ * filter takes over from checking every start: any hit matches one of the
+ * seeds exactly, so only the starts where an Aho-Corasick scan finds a seed
+ * are checked. On packed data, each start's window of 2-bit codes is XORed
+ * with the packed pattern and the mismatching bases are counted with a
+ * popcount, eight starts at a time with AVX-512 where the CPU has it.
+ */
+struct hamming {
+  const char *pattern;
+  int length;
+  unsigned char *masks;			/* With -i, base set of each position */
+  int num_seeds;				/* Pigeonhole seeds, or 0 to try every start */
+  int *seed_starts;				/* Offset of each seed in the pattern */
+  automaton_t *seeds;			/* Aho-Corasick automaton over the seeds */
+  long (*scan)(const query_t *query, int i, fasta_t *fasta, long begin, long end,
+			   long base_offset, scratch_t *scratch);	/* Scan for the pattern's hits */
+};
+
+/* Seeds shorter than this match too often by chance to filter well. */
+#define HAMMING_MIN_SEED 12
+
+/* Count the mismatches between 'length' bytes at 'p' and 'pattern', giving
+ * up once there are more than 'limit'. With 'iupac', 'pattern' holds IUPAC
+ * codes.
+ */
+int
+hamming_distance(const char *p, const char *pattern, int length, int limit, int iupac)
+{
+  int mismatches = 0;
+  for (int j = 0;  j < length && mismatches <= limit;  j++) {
+	mismatches += !myers_matches(p[j], pattern[j], iupac);
+  }
+  return mismatches;
+}
+
+/* Count a Hamming hit of pattern 'i' at offset 'start', if it is one. */
+int
+hamming_check(const query_t *query, int i, fasta_t *fasta, long start, long base_offset,
+			  scratch_t *scratch)
+{
+  const hamming_t *hm = &query->hamming[i];
+  char *p = fasta->sequence + start;
+  int mismatches = hamming_distance(p, hm->pattern, hm->length, query->max_edits,
+									  query->iupac);
+  if (mismatches > query->max_edits) {
+	return 0;
+  }
+  if (query->locate) {
+	hit_add(&scratch->hits, base_offset + start, hm->length, i, mismatches);
+  }
+  return 1;
+}
+
+/* Count the Hamming hits of pattern 'i' starting anywhere in [begin, end) of
+ * the FASTA data, checking each start in turn.
+ */
+long
+hamming_scan_scalar(const query_t *query, int i, fasta_t *fasta, long begin, long end,
+					long base_offset, scratch_t *scratch)
+{
+  long local_count = 0;
+  for (long start = begin;  start < end;  start++) {
+	local_count += hamming_check(query, i, fasta, start, base_offset, scratch);
+  }
+  return local_count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* As hamming_scan_scalar(), but counts the mismatches of 32 starts at once
+ * in a vector of bytes with AVX2, and stops comparing once every one of
+ * them has more than 'max_edits'. Patterns over 255 bases would overflow
+ * the byte counts, so are left to hamming_scan_scalar().
+ */
+__attribute__((target("avx2")))
+long
+hamming_scan_avx2(const query_t *query, int i, fasta_t *fasta, long begin, long end,
+				  long base_offset, scratch_t *scratch)
+{
+  const hamming_t *hm = &query->hamming[i];
+  int length = hm->length;
+  const char *sequence = fasta->sequence;
+  const __m256i limit = _mm256_set1_epi8(query->max_edits);
+  const __m256i zero = _mm256_setzero_si256();
+  long local_count = 0;
+  long start = begin;
+
+  while (length <= 255 && start + 32 <= end && start + 32 + length - 1 <= fasta->cur_length) {
+	__m256i mismatches = zero;
+	unsigned int alive = ~0u;
+	for (int j = 0;  j < length && alive;  j++) {
+	  __m256i block = _mm256_loadu_si256((const __m256i *)(sequence + start + j));
+	  __m256i differ;
+	  if (hm->masks) {
+		differ = _mm256_cmpeq_epi8(_mm256_and_si256(iupac_base_masks_avx2(block),
+													_mm256_set1_epi8(hm->masks[j])),
+								   zero);
+	  } else {
+		differ = _mm256_xor_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(hm->pattern[j])),
+								  _mm256_set1_epi8(-1));
+	  }
+	  mismatches = _mm256_sub_epi8(mismatches, differ);
+	  if ((j & 7) == 7) {
+		alive = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(mismatches, limit),
+													   mismatches));
+	  }
+	}
+	alive = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(mismatches, limit), mismatches));
+	while (alive) {
+	  long hit = start + __builtin_ctz(alive);
+	  if (query->locate) {
+		hit_add(&scratch->hits, base_offset + hit, length, i,
+				hamming_distance(sequence + hit, hm->pattern, length, length, query->iupac));
+	  }
+	  local_count++;
+	  alive &= alive - 1;
+	}
+	start += 32;
+  }
+  return local_count + hamming_scan_scalar(query, i, fasta, start, end, base_offset, scratch);
+}
+#endif
+
+/* Count the Hamming hits of pattern 'i' starting anywhere in [begin, end) of
+ * the FASTA data through its pigeonhole seeds. A start is checked when the
+ * first of its seeds that matches exactly is found, so it is counted once
+ * however many of its seeds match.
+ */
+long
+hamming_scan_seeds(const query_t *query, int i, fasta_t *fasta, long begin, long end,
+				   long base_offset, scratch_t *scratch)
+{
+  const hamming_t *hm = &query->hamming[i];
+  const automaton_t *ac = hm->seeds;
+  const int32_t *next = ac->next;
+  const unsigned char *symbol = ac->symbol;
+  int size = ac->alphabet_size;
+  const char *sequence = fasta->sequence;
+  long scan_end = end + hm->length - 1 < fasta->cur_length ? end + hm->length - 1 : fasta->cur_length;
+  long local_count = 0;
+
+  int32_t state = 0;
+  for (long p = begin;  p < scan_end;  p++) {
+	state = next[(state >> 1) + symbol[(unsigned char)sequence[p]]];
+	if (!(state & 1)) {
+	  continue;
+	}
+	for (int s = (state >> 1) / size;  s != 0;  s = ac->match_link[s]) {
+	  for (int t = ac->first_match[s];  t >= 0;  t = ac->next_match[t]) {
+		int seed = ac->owner[t];
+		long start = p - hm->seed_starts[seed + 1] + 1;
+		if (start < begin || start >= end) {
+		  continue;
+		}
+		int earlier = 0;
+		for (int e = 0;  e < seed && !earlier;  e++) {
+		  earlier = memcmp(sequence + start + hm->seed_starts[e], hm->pattern + hm->seed_starts[e],
+						   hm->seed_starts[e + 1] - hm->seed_starts[e]) == 0;
+		}
+		if (!earlier) {
+		  local_count += hamming_check(query, i, fasta, start, base_offset, scratch);
+		}
+	  }
+	}
+  }
+  return local_count;
+}
+
+/* Count the Hamming hits of each of a query's patterns starting anywhere in
+ * [begin, end) of the FASTA data, one pattern after another over the same
+ * cache-sized block. Adds the number of starts tried to 'scratch->trials'.
+ */
+long
+match_hamming(const query_t *query, fasta_t *fasta, char *begin, char *end,
+			  long base_offset, scratch_t *scratch)
+{
+  int num_patterns = query->patterns ? query->num_patterns : 1;
+  long local_count = 0;
+  for (int i = 0;  i < num_patterns;  i++) {
+	const hamming_t *hm = &query->hamming[i];
+	long last_end = fasta->cur_length - hm->length + 1;
+	long pattern_end = end - fasta->sequence < last_end ? end - fasta->sequence : last_end;
+	if (pattern_end <= begin - fasta->sequence) {
+	  continue;
+	}
+	long count = hm->scan(query, i, fasta, begin - fasta->sequence, pattern_end, base_offset,
+							scratch);
+	if (query->patterns) {
+	  scratch->pattern_counts[i] += count;
+	}
+	local_count += count;
+	scratch->trials += pattern_end - (begin - fasta->sequence);
+  }
+  return local_count;
+}
+
+/* Set up Hamming matching of 'pattern', as pattern 'i' of a query. */
+void
+hamming_build(query_t *query, int i, const char *pattern)
+{
+  hamming_t *hm = &query->hamming[i];
+  hm->pattern = pattern;
+  hm->length = strlen(pattern);
+  hm->scan = hamming_scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  if (cpu_features & CPU_AVX2) {
+	hm->scan = hamming_scan_avx2;
+  }
+#endif
+  if (query->iupac) {
+	hm->masks = malloc(hm->length);
+	for (int j = 0;  j < hm->length;  j++) {
+	  hm->masks[j] = iupac_code_mask(pattern[j]);
+	  if (hm->masks[j] == 0) {
+		fprintf(stderr, "'%c' in pattern '%s' isn't an IUPAC code\n", pattern[j], pattern);
+		exit(1);
+	  }
+	}
+	return;
+  }
+  if ((hm->scan != hamming_scan_scalar && hm->length <= 255) ||
+	  hm->length / (query->max_edits + 1) < HAMMING_MIN_SEED) {
+	return;
+  }
+
+  /* Seed 's' is [seed_starts[s], seed_starts[s + 1]) of the pattern. */
+  hm->num_seeds = query->max_edits + 1;
+  hm->seed_starts = malloc((hm->num_seeds + 1) * sizeof(int));
+  char *seeds[hm->num_seeds];
+  for (int s = 0;  s <= hm->num_seeds;  s++) {
+	hm->seed_starts[s] = s * hm->length / hm->num_seeds;
+  }
+  for (int s = 0;  s < hm->num_seeds;  s++) {
+	seeds[s] = strndup(pattern + hm->seed_starts[s], hm->seed_starts[s + 1] - hm->seed_starts[s]);
+  }
+  hm->seeds = automaton_create(seeds, hm->num_seeds, query->iupac);
+  for (int s = 0;  s < hm->num_seeds;  s++) {
+	free(seeds[s]);
+  }
+  hm->scan = hamming_scan_seeds;
+}
+
+/* Count a Hamming candidate at 'start' in a packed FASTA structure whose
+ * XORed words came to 'mismatches', if it is a hit. The popcount never
+ * exceeds the true number of mismatches, and is exact unless the window
+ * holds non-ACGT data or the pattern isn't plain ACGT, in which case the
+ * candidate is decoded and counted byte by byte.
+ */
+int
+packed_hamming_check(const query_t *query, fasta_t *fasta, long start, int mismatches,
+					 scratch_t *scratch)
+{
+  int length = query->max_length;
+  long e = fasta_first_exception(fasta, start);
+  if (query->iupac || !query->packed_plain ||
+	  (e < fasta->num_exceptions && fasta->exceptions[e].start < start + length)) {
+	char candidate[length];
+	fasta_unpack(fasta, start, length, candidate);
+	mismatches = hamming_distance(candidate, query->pattern, length, query->max_edits,
+								  query->iupac);
+	if (mismatches > query->max_edits) {
+	  return 0;
+	}
+  }
+  if (query->locate) {
+	hit_add(&scratch->hits, start, length, 0, mismatches);
+  }
+  return 1;
+}
+
+/* Count the mismatching bases in a word of XORed 2-bit codes. */
+#define PACKED_MISMATCHES(x, mask) __builtin_popcountll(((x) | (x) >> 1) & (mask) & 0x5555555555555555ull)
+
+/* Count the Hamming hits of a query's pattern starting anywhere in [begin,
+ * end) of a packed FASTA structure, one start at a time, with XOR and
+ * popcount over the packed pattern's words.
+ */
+long
+packed_hamming_scalar(const query_t *query, fasta_t *fasta, long begin, long end,
+					  scratch_t *scratch)
+{
+  const unsigned char *packed = fasta->packed;
+  int k = query->max_edits;
+  long local_count = 0;
+  for (long i = begin;  i < end;  i++) {
+	long byte = i >> 2;
+	int phase = i & 3;
+	int mismatches = 0;
+	for (int w = 0;  w < query->packed_num_words[phase] && mismatches <= k;  w++) {
+	  uint64_t x = packed_load(packed, byte + 8 * w) ^ query->packed_words[phase][w];
+	  mismatches += PACKED_MISMATCHES(x, query->packed_masks[phase][w]);
+	}
+	if (mismatches <= k) {
+	  local_count += packed_hamming_check(query, fasta, i, mismatches, scratch);
+	}
+  }
+  scratch->trials += end - begin;
+  return local_count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* As packed_hamming_scalar(), for patterns of up to 29 bases, whose packed
+ * window at any phase fits one word: the eight starts in two bytes of packed
+ * data are counted at once, one per 64-bit lane, with VPOPCNTDQ.
+ */
+AVX512_VPOPCNTDQ_TARGET
+long
+packed_hamming_avx512(const query_t *query, fasta_t *fasta, long begin, long end,
+					  scratch_t *scratch)
+{
+  const unsigned char *packed = fasta->packed;
+  const uint64_t *const *words = (const uint64_t *const *)query->packed_words;
+  const uint64_t *const *masks = (const uint64_t *const *)query->packed_masks;
+  const __m512i pattern = _mm512_setr_epi64(words[0][0], words[1][0], words[2][0], words[3][0],
+											words[0][0], words[1][0], words[2][0], words[3][0]);
+  const __m512i mask = _mm512_and_si512(_mm512_setr_epi64(masks[0][0], masks[1][0], masks[2][0],
+														  masks[3][0], masks[0][0], masks[1][0],
+														  masks[2][0], masks[3][0]),
+										_mm512_set1_epi64(0x5555555555555555ll));
+  const __m512i limit = _mm512_set1_epi64(query->max_edits);
+  long local_count = 0;
+
+  for (long i = begin & ~3;  i < end;  i += 8) {
+	__m512i data = _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_set1_epi64x(packed_load(packed, i >> 2))),
+									  _mm256_set1_epi64x(packed_load(packed, (i >> 2) + 1)), 1);
+	__m512i x = _mm512_xor_si512(data, pattern);
+	__m512i counts = _mm512_popcnt_epi64(_mm512_and_si512(_mm512_or_si512(x, _mm512_srli_epi64(x, 1)), mask));
+	unsigned int hits = _mm512_cmple_epu64_mask(counts, limit);
+	while (hits) {
+	  int lane = __builtin_ctz(hits);
+	  long start = i + lane;
+	  if (start >= begin && start < end) {
+		uint64_t lane_counts[8];
+		_mm512_storeu_si512(lane_counts, counts);
+		local_count += packed_hamming_check(query, fasta, start, lane_counts[lane], scratch);
+	  }
+	  hits &= hits - 1;
+	}
+  }
+  scratch->trials += end - begin;
+  return local_count;
+}
+#endif
+
+/* Read the patterns in 'file_name', one per line, skipping blank lines.
+ * Stores the number read in '*num_patterns'.
+ */
+char **
+read_patterns(char *file_name, int *num_patterns)
+{
+  FILE *fp = fopen(file_name, "r");
+  if (!fp) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+  int max_patterns = 1024;
+  char **patterns = malloc(max_patterns * sizeof(char *));
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t got;
+  *num_patterns = 0;
+  while ((got = getline(&line, &line_size, fp)) > 0) {
+	while (got > 0 && (line[got - 1] == '\n' || line[got - 1] == '\r')) {
+	  line[--got] = '\0';
+	}
+	if (got == 0) {
+	  continue;
+	}
+	if (*num_patterns == max_patterns) {
+	  max_patterns *= 2;
+	  patterns = realloc(patterns, max_patterns * sizeof(char *));
+	}
+	patterns[(*num_patterns)++] = strdup(line);
+  }
+  free(line);
+  fclose(fp);
+
+  if (*num_patterns == 0) {
+	fprintf(stderr, "No patterns in '%s'\n", file_name);
+	exit(1);
+  }
+  return patterns;
+}
+
+/* Return the reverse complement of 'pattern' as a new string. IUPAC
+ * ambiguity codes complement to the code for the complementary bases, case
+ * is kept, and any other byte stands for itself.
+ */
+char *
+reverse_complement(const char *pattern)
+{
+  static const char bases[] = "ACGTRYKMBVDHSWNacgtrykmbvdhswn";
+  static const char complements[] = "TGCAYRMKVBHDSWNtgcayrmkvbhdswn";
+  int length = strlen(pattern);
+  char *reverse = malloc(length + 1);
+  for (int i = 0;  i < length;  i++) {
+	const char *base = strchr(bases, pattern[length - 1 - i]);
+	reverse[i] = base && *base ? complements[base - bases] : pattern[length - 1 - i];
+  }
+  reverse[length] = '\0';
+  return reverse;
+}
+
+/* For -r: return the 'num_patterns' patterns followed by the reverse
+ * complement of each, so both strands are searched in one pass, storing the
+ * number of patterns in '*num_searched'. Patterns that are their own reverse
+ * complement would otherwise count every match twice, so they get no
+ * reverse entry and all their matches count as forward. 'reverse[i]' is set
+ * to the index of the reverse complement of pattern i, or -1 if it has none.
+ */
+char **
+strand_patterns(char **patterns, int num_patterns, int *num_searched, int *reverse)
+{
+  char **searched = malloc(2 * num_patterns * sizeof(char *));
+  memcpy(searched, patterns, num_patterns * sizeof(char *));
+  *num_searched = num_patterns;
+  for (int i = 0;  i < num_patterns;  i++) {
+	char *complement = reverse_complement(patterns[i]);
+	if (strcmp(complement, patterns[i]) == 0) {
+	  free(complement);
+	  reverse[i] = -1;
+	} else {
+	  reverse[i] = *num_searched;
+	  searched[(*num_searched)++] = complement;
+	}
+  }
+  return searched;
+}
+
+/* Pack 'pattern' once for each of the four positions a base can have within
+ * a byte of packed data, with masks for the bits holding pattern bases, so
+ * packed_match_range() can compare whole words. With -i, positions whose code
+ * stands for more than one base are left out of the masks, so the words only
+ * filter on the plain ones.
+ */
+void
+query_pack(query_t *query)
+{
+  const char *pattern = query->pattern;
+  int pattern_length = query->max_length;
+  int num_words = (2 * (pattern_length + 3) + 63) / 64;
+  query->packed_plain = 1;
+  for (int phase = 0;  phase < 4;  phase++) {
+	query->packed_words[phase] = calloc(num_words, sizeof(uint64_t));
+	query->packed_masks[phase] = calloc(num_words, sizeof(uint64_t));
+	query->packed_num_words[phase] = (2 * (phase + pattern_length) + 63) / 64;
+	for (int j = 0;  j < pattern_length;  j++) {
+	  const char *base = strchr("ACGTacgt", pattern[j]);
+	  int code = base ? (base - "ACGTacgt") & 3 : 0;
+	  int bit = 2 * (phase + j);
+	  if (query->iupac) {
+		int mask = iupac_code_mask(pattern[j]);
+		if (__builtin_popcount(mask) != 1) {
+		  continue;
+		}
+		code = __builtin_ctz(mask);
+	  }
+	  query->packed_words[phase][bit / 64] |= (uint64_t)code << (bit % 64);
+	  query->packed_masks[phase][bit / 64] |= (uint64_t)3 << (bit % 64);
+	  if (base == NULL || base - "ACGTacgt" >= 4) {
+		query->packed_plain = 0;
+	  }
+	}
+  }
+}
+
+/* A kernel for a single pattern, as listed in a kernel registry. */
+typedef struct {
+  const char *name;
+  int features;					/* CPU_* features it needs */
+  int min_length;				/* Pattern lengths it takes */
+  int max_length;
+  const match_kernel_t (*fixed)[2];	/* Kernels by length, counting and
+									 * locating, or NULL to use the two below */
+  match_kernel_t count;
+  match_kernel_t locate;
+  void (*build)(query_t *query);	/* Builds its tables, if it has any */
+} kernel_entry_t;
+
+/* Build the query's BMH shift table. */
+void
+bmh_setup(query_t *query)
+{
+  query->bmh_shift = bmh_build(query->pattern);
+}
+
+/* Kernel registries for a single pattern, plain or IUPAC, best first. Each
+ * ends with a kernel that takes any pattern on any CPU.
+ */
+static const kernel_entry_t exact_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  { "avx512", CPU_AVX512BW, 1, FIXED_MAX_LENGTH, match_avx512_fixed, NULL, NULL, NULL },
+  { "avx2", CPU_AVX2, 1, FIXED_MAX_LENGTH, match_avx2_fixed, NULL, NULL, NULL },
+#endif
+  { "bmh", 0, BMH_MIN_LENGTH + 1, INT_MAX, NULL, match_bmh_count, match_bmh_locate, bmh_setup },
+#if defined(__x86_64__) || defined(__i386__)
+  { "sse4.2", CPU_SSE42, 1, BMH_MIN_LENGTH, NULL, match_sse42_count, match_sse42_locate, NULL },
+#endif
+  { "scalar", 0, 1, INT_MAX, NULL, match_scalar_count, match_scalar_locate, NULL },
+};
+
+static const kernel_entry_t iupac_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  { "iupac-avx512", CPU_AVX512BW | CPU_AVX512VBMI, 1, INT_MAX, NULL,
+	match_iupac_avx512_count, match_iupac_avx512_locate, NULL },
+  { "iupac-avx2", CPU_AVX2, 1, INT_MAX, NULL, match_iupac_avx2_count, match_iupac_avx2_locate, NULL },
+  { "iupac-sse4.2", CPU_SSE42, 1, INT_MAX, NULL, match_iupac_sse42_count,
+	match_iupac_sse42_locate, NULL },
+#endif
+  { "iupac-scalar", 0, 1, INT_MAX, NULL, match_iupac_scalar_count, match_iupac_scalar_locate, NULL },
+};
+
+/* Give the query the first kernel in 'registry' that the CPU can run and
+ * that takes its pattern's length.
+ */
+void
+kernel_select(query_t *query, const kernel_entry_t *registry)
+{
+  const kernel_entry_t *entry = registry;
+  while ((entry->features & ~cpu_features) != 0 || query->max_length < entry->min_length ||
+		 query->max_length > entry->max_length) {
+	entry++;
+  }
+  if (entry->build) {
+	entry->build(query);
+  }
+  if (entry->fixed) {
+	query->kernel = entry->fixed[query->max_length][query->locate];
+  } else {
+	query->kernel = query->locate ? entry->locate : entry->count;
+  }
+  query->kernel_name = entry->name;
+}
+
+/* Compile a search with 'options' for either one 'pattern' or a set of
+ * 'patterns', picking its kernel: mismatch counting for Hamming matching
+ * (-k --hamming), Myers bit-vectors for approximate matching (-k),
+ * Aho-Corasick for a set, and for a single pattern a bit-parallel engine
+ * (--engine) or the best kernel in its registry that the CPU runs.
+ */
+query_t *
+query_create(const char *pattern, char **patterns, int num_patterns,
+			 const query_options_t *options)
+{
+  query_t *query = calloc(1, sizeof(query_t));
+  query->pattern = pattern;
+  query->patterns = patterns;
+  query->num_patterns = num_patterns;
+  query->iupac = options->iupac;
+  query->locate = options->locate;
+  query->max_edits = options->max_edits;
+  query->kernel = KERNEL(match_scalar, query->locate);
+  query->kernel_name = "scalar";
+
+  if (query->max_edits > 0 && options->hamming) {
+	int num_hamming = pattern ? 1 : num_patterns;
+	query->hamming = calloc(num_hamming, sizeof(hamming_t));
+	for (int i = 0;  i < num_hamming;  i++) {
+	  const char *text = pattern ? pattern : patterns[i];
+	  int length = strlen(text);
+	  if (length <= query->max_edits) {
+		fprintf(stderr, "Pattern '%s' is too short for %d mismatches\n", text, query->max_edits);
+		exit(1);
+	  }
+	  query->min_length = i == 0 || length < query->min_length ? length : query->min_length;
+	  query->max_length = length > query->max_length ? length : query->max_length;
+	  hamming_build(query, i, text);
+	}
+	query->kernel = match_hamming;
+	query->kernel_name = "hamming";
+	if (pattern) {
+	  query_pack(query);
+	  query->packed_kernel = packed_hamming_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	  if (query->max_length <= 29 &&
+		  (cpu_features & (CPU_AVX512BW | CPU_AVX512VPOPCNTDQ)) ==
+		  (CPU_AVX512BW | CPU_AVX512VPOPCNTDQ)) {
+		query->packed_kernel = packed_hamming_avx512;
+	  }
+#endif
+	}
+	return query;
+  }
+
+  if (query->max_edits > 0) {
+	/* Hits run from 1 base up to a pattern plus its edits, and a job needs
+	 * one more base before its first end position to warm up on.
+	 */
+	int num_myers = pattern ? 1 : num_patterns;
+	query->myers = calloc(num_myers, sizeof(myers_t));
+	query->min_length = 1;
+	for (int i = 0;  i < num_myers;  i++) {
+	  const char *text = pattern ? pattern : patterns[i];
+	  if ((int)strlen(text) <= query->max_edits) {
+		fprintf(stderr, "Pattern '%s' is too short for %d edits\n", text, query->max_edits);
+		exit(1);
+	  }
+	  myers_build(&query->myers[i], text, query->iupac);
+	  if (query->myers[i].length + query->max_edits + 1 > query->max_length) {
+		query->max_length = query->myers[i].length + query->max_edits + 1;
+	  }
+	}
+	query->kernel = match_myers;
+	query->kernel_name = "myers";
+	return query;
+  }
+
+  if (pattern == NULL) {
+	query->min_length = query->max_length = strlen(patterns[0]);
+	for (int i = 1;  i < num_patterns;  i++) {
+	  int length = strlen(patterns[i]);
+	  query->min_length = length < query->min_length ? length : query->min_length;
+	  query->max_length = length > query->max_length ? length : query->max_length;
+	}
+	query->automaton = automaton_create(patterns, num_patterns, query->iupac);
+	query->kernel = KERNEL(match_ac, query->locate);
+	query->kernel_name = "aho-corasick";
+	return query;
+  }
+
+  query->min_length = query->max_length = strlen(pattern);
+  query_pack(query);
+  if (query->max_length == 0) {
+	return query;
+  }
+  if (query->iupac) {
+	iupac_build(query);
+  }
+  int chosen = options->engine;
+  if (chosen != ENGINE_AUTO && query->max_length > BIT_PARALLEL_MAX_LENGTH) {
+	fprintf(stderr, "Pattern '%s' is too long for --engine (at most %d bases)\n",
+			pattern, BIT_PARALLEL_MAX_LENGTH);
+	exit(1);
+  }
+  if (chosen == ENGINE_AUTO && query->iupac && query->max_length <= BIT_PARALLEL_MAX_LENGTH) {
+	chosen = query->max_length >= BNDM_MIN_LENGTH ? ENGINE_BNDM : ENGINE_SHIFT_OR;
+  }
+  if (chosen == ENGINE_SHIFT_OR) {
+	bit_masks_build(query, 0);
+	query->kernel = KERNEL(match_shift_or, query->locate);
+	query->kernel_name = "shift-or";
+	return query;
+  }
+  if (chosen == ENGINE_BNDM) {
+	bit_masks_build(query, 1);
+	query->kernel = KERNEL(match_bndm, query->locate);
+	query->kernel_name = "bndm";
+	return query;
+  }
+  kernel_select(query, query->iupac ? iupac_kernels : exact_kernels);
+  return query;
+}
+
+/* Destroy a compiled search. The patterns themselves belong to the caller. */
+void
+query_destroy(query_t *query)
+{
+  if (query->automaton) {
+	automaton_destroy(query->automaton);
+  }
+  for (int phase = 0;  phase < 4;  phase++) {
+	free(query->packed_words[phase]);
+	free(query->packed_masks[phase]);
+  }
+  free(query->bmh_shift);
+  free(query->iupac_masks);
+  free(query->bit_masks);
+  for (int i = 0;  query->myers && i < (query->pattern ? 1 : query->num_patterns);  i++) {
+	free(query->myers[i].peq);
+	free(query->myers[i].reverse_peq);
+  }
+  free(query->myers);
+  for (int i = 0;  query->hamming && i < (query->pattern ? 1 : query->num_patterns);  i++) {
+	free(query->hamming[i].masks);
+	free(query->hamming[i].seed_starts);
+	if (query->hamming[i].seeds) {
+	  automaton_destroy(query->hamming[i].seeds);
+	}
+  }
+  free(query->hamming);
+  free(query);
+}
+
+/* Count matches of a query starting anywhere in [begin, end) of the FASTA
+ * data with the query's kernel. Starts too close to the end of the data for
+ * even the shortest pattern to fit are dropped, so no kernel ever compares
+ * past the end of the sequence.
+ */
+long
+match_range(const query_t *query, fasta_t *fasta, char *begin, char *end,
+			long base_offset, scratch_t *scratch)
+{
+  char *last_end = fasta->sequence + fasta->cur_length - query->min_length + 1;
+  if (end > last_end) {
+	end = last_end;
+  }
+  if (end <= begin) {
+	return 0;
+  }
+  return query->kernel(query, fasta, begin, end, base_offset, scratch);
+}
+
+/* Count matches of a query's pattern starting anywhere in [begin, end) of a
+ * packed FASTA structure, as match_range() does for text. Each candidate is
+ * checked with whole 64-bit word compares of the pre-packed pattern straight
+ * against the packed data. Candidates that touch a run of non-ACGT data are
+ * decoded and checked byte by byte, as are all candidates for an IUPAC
+ * pattern.
+ */
+long
+packed_match_range(const query_t *query, fasta_t *fasta, long begin, long end,
+				   scratch_t *scratch)
+{
+  const char *pattern = query->pattern;
+  int pattern_length = query->max_length;
+  if (end > fasta->cur_length - pattern_length + 1) {
+	end = fasta->cur_length - pattern_length + 1;
+  }
+  if (end <= begin) {
+	return 0;
+  }
+  if (query->packed_kernel) {
+	return query->packed_kernel(query, fasta, begin, end, scratch);
+  }
+
+  const unsigned char *packed = fasta->packed;
+  char candidate[pattern_length];
+  long local_count = 0;
+  for (long i = begin;  i < end;  i++) {
+	long byte = i >> 2;
+	int phase = i & 3;
+	const uint64_t *words = query->packed_words[phase];
+	const uint64_t *masks = query->packed_masks[phase];
+	int w = 0;
+	while (w < query->packed_num_words[phase] &&
+		   (packed_load(packed, byte + 8 * w) & masks[w]) == words[w]) {
+	  w++;
+	}
+	if (w < query->packed_num_words[phase]) {
+	  continue;
+	}
+
+	/* The bases match; rule out any non-ACGT data under the pattern. */
+	long e = fasta_first_exception(fasta, i);
+	if (query->iupac_masks) {
+	  fasta_unpack(fasta, i, pattern_length, candidate);
+	  if (!iupac_compare(query, candidate)) {
+		continue;
+	  }
+	} else if (e < fasta->num_exceptions && fasta->exceptions[e].start < i + pattern_length) {
+	  if (query->packed_plain) {
+		continue;
+	  }
+	  fasta_unpack(fasta, i, pattern_length, candidate);
+	  if (memcmp(candidate, pattern, pattern_length) != 0) {
+		continue;
+	  }
+	} else if (!query->packed_plain) {
+	  continue;
+	}
+
+	if (query->locate) {
+	  hit_add(&scratch->hits, i, pattern_length, 0, -1);
+	}
+	local_count++;
+  }
+  scratch->trials += end - begin;
+  return local_count;
+}
+
+/* Count matches of a query starting anywhere in [begin, end) of a FASTA
+ * structure, text or packed, one contig at a time. Each contig is searched
+ * through a view of the data that ends where the contig does, so no match
+ * can run from one record into the next. 'base_offset' is the offset of the
+ * structure's data in the whole sequence, which the contig table indexes.
+ */
+long
+search_range(const query_t *query, fasta_t *fasta, long begin, long end,
+			 long base_offset, scratch_t *scratch)
+{
+  const contig_table_t *contigs = &fasta->contigs;
+  long local_count = 0;
+  long c = contig_find(contigs, base_offset + begin);
+  if (c < 0) {
+	c = 0;
+  }
+  while (begin < end) {
+	fasta_t view = *fasta;
+	long view_end = end;
+	if (c < contigs->count) {
+	  const contig_t *contig = &contigs->entries[c];
+	  long contig_end = contig->start + contig->length - base_offset;
+	  if (contig_end < view.cur_length) {
+		view.cur_length = contig_end;
+	  }
+	  if (contig_end < view_end) {
+		view_end = contig_end;
+	  }
+	}
+	if (view_end > begin && fasta->packed) {
+	  local_count += packed_match_range(query, &view, begin, view_end, scratch);
+	} else if (view_end > begin) {
+	  local_count += match_range(query, &view, fasta->sequence + begin,
+								 fasta->sequence + view_end, base_offset, scratch);
+	}
+	begin = view_end > begin ? view_end : begin;
+	c++;
+  }
+  return local_count;
+}
+
+/* Workers search a job a block of start positions at a time, claiming blocks
+ * from the job's cursor as they go, so a worker slowed by dense matches or a
+ * busy core just claims fewer blocks rather than holding up the rest. Blocks
+ * are sized to stay in cache.
+ */
+#define BLOCK_SIZE (256 * 1024)
+
+/* One search of a FASTA structure, submitted to a search context. Doubles as
+ * the future for its results: search_wait() blocks until 'done' is set, after
+ * which the counts are final.
+ */
+typedef struct search_job {
+  const query_t *query;
+  fasta_t *fasta;
+  long begin;					/* Start positions to search, [begin, end) */
+  long end;
+  long base_offset;				/* Added to offsets printed for matches */
+  long next_block;				/* Next unclaimed block */
+  int active;					/* Workers currently on the job */
+  int queued;					/* Still has blocks left to claim */
+  int done;
+  long match_count;				/* Results */
+  long trial_count;
+  long *pattern_counts;			/* Matches of each of query->patterns */
+  hit_list_t hits;				/* With -v, the matches, in no particular order */
+  pthread_cond_t done_cond;		/* Signaled when 'done' is set */
+  struct search_job *next;		/* Next job in the queue */
+} search_job_t;
+
+typedef struct search_context search_context_t;
+
+/* A worker thread and its reusable scratch space. */
+typedef struct {
+  search_context_t *context;
+  pthread_t thread;
+  int cpu;						/* CPU the worker is pinned to, or -1 */
+  scratch_t scratch;
+} worker_t;
+
+/* A pool of pinned worker threads that searches jobs handed to it by
+ * search_submit(). Workers hand out blocks to the queued jobs in turn, so
+ * jobs submitted together (a batch of patterns, or queries from several
+ * clients) share the pool fairly, and a small job queued behind a large one
+ * finishes in about the time it would take alone.
+ */
+struct search_context {
+  worker_t *workers;
+  int num_workers;
+  pthread_mutex_t mutex;		/* Guards everything below and job state */
+  pthread_cond_t work_cond;		/* Signaled when a job is queued */
+  search_job_t *head;			/* Jobs with blocks left to claim */
+  search_job_t *tail;
+  search_job_t *turn;			/* Job whose turn it is, or NULL for 'head' */
+  int shutdown;
+};
+
+/* Claim the next unsearched block of a job's start positions into
+ * [*begin, *end). Called with the context's mutex held, and only for queued
+ * jobs, which always have a block left.
+ */
+void
+claim_block(search_job_t *job, long *begin, long *end)
+{
+  *begin = job->begin + job->next_block++ * BLOCK_SIZE;
+  *end = *begin + BLOCK_SIZE < job->end ? *begin + BLOCK_SIZE : job->end;
+}
+
+/* Take a job whose blocks have all been claimed off the queue. */
+void
+dequeue_job(search_context_t *context, search_job_t *job)
+{
+  search_job_t **link = &context->head;
+  search_job_t *prev = NULL;
+  while (*link != job) {
+	prev = *link;
+	link = &prev->next;
+  }
+  *link = job->next;
+  if (context->tail == job) {
+	context->tail = prev;
+  }
+  if (context->turn == job) {
+	context->turn = job->next;
+  }
+  job->queued = 0;
+}
+
+/* My parallel implementation of match(): a worker thread that searches
+ * blocks of the queued jobs, taking them in turn, until its search context
+ * shuts down.
+ */
+void *
+parallel_match(void *ptr)
+{
+  worker_t *worker = ptr;
+  search_context_t *context = worker->context;
+  scratch_t *scratch = &worker->scratch;
+
+  if (worker->cpu >= 0) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(worker->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  pthread_mutex_lock(&context->mutex);
+  while (1) {
+	while (context->head == NULL && !context->shutdown) {
+	  pthread_cond_wait(&context->work_cond, &context->mutex);
+	}
+	if (context->head == NULL) {
+	  break;
+	}
+	search_job_t *job = context->turn ? context->turn : context->head;
+	context->turn = job->next;
+	long begin;
+	long end;
+	claim_block(job, &begin, &end);
+	if (end == job->end) {
+	  dequeue_job(context, job);
+	}
+	job->active++;
+	pthread_mutex_unlock(&context->mutex);
+
+	/* Reset the scratch space for this block, growing it if need be. */
+	const query_t *query = job->query;
+	fasta_t *fasta = job->fasta;
+	int num_patterns = query->num_patterns;
+	if (num_patterns > scratch->max_patterns) {
+	  free(scratch->pattern_counts);
+	  scratch->pattern_counts = malloc(num_patterns * sizeof(long));
+	  scratch->max_patterns = num_patterns;
+	}
+	memset(scratch->pattern_counts, 0, num_patterns * sizeof(long));
+	scratch->trials = 0;
+
+	long local_count = search_range(query, fasta, begin, end, job->base_offset, scratch);
+
+	// mutex stuff! once we have the local count
+	pthread_mutex_lock(&context->mutex);
+	job->match_count += local_count;
+	job->trial_count += scratch->trials;
+	for (int i = 0;  i < num_patterns;  i++) {
+	  job->pattern_counts[i] += scratch->pattern_counts[i];
+	}
+	hit_list_append(&job->hits, &scratch->hits);
+	if (--job->active == 0 && !job->queued) {
+	  job->done = 1;
+	  pthread_cond_broadcast(&job->done_cond);
+	}
+  }
+  pthread_mutex_unlock(&context->mutex);
+
+  return (void *)NULL;
+}
+
+/* Create a search context with a pool of 'num_workers' threads, each pinned
+ * to its own CPU (wrapping around if there are more workers than CPUs).
+ */
+search_context_t *
+search_context_create(int num_workers)
+{
+  search_context_t *context = calloc(1, sizeof(search_context_t));
+  context->num_workers = num_workers;
+  context->workers = calloc(num_workers, sizeof(worker_t));
+  check_thread_rtn("mutex init", pthread_mutex_init(&context->mutex, NULL));
+  check_thread_rtn("cond init", pthread_cond_init(&context->work_cond, NULL));
+
+  cpu_set_t allowed;
+  int num_cpus = 0;
+  int cpus[CPU_SETSIZE];
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+	for (int cpu = 0;  cpu < CPU_SETSIZE;  cpu++) {
+	  if (CPU_ISSET(cpu, &allowed)) {
+		cpus[num_cpus++] = cpu;
+	  }
+	}
+  }
+
+  for (int i = 0;  i < num_workers;  i++) {
+	worker_t *worker = &context->workers[i];
+	worker->context = context;
+	worker->cpu = num_cpus > 0 ? cpus[i % num_cpus] : -1;
+	check_thread_rtn("create", pthread_create(&worker->thread, NULL, parallel_match, worker));
+  }
+  return context;
+}
+
+/* Stop a search context's workers, once the queued jobs are finished. */
+void
+search_context_destroy(search_context_t *context)
+{
+  pthread_mutex_lock(&context->mutex);
+  context->shutdown = 1;
+  pthread_cond_broadcast(&context->work_cond);
+  pthread_mutex_unlock(&context->mutex);
+
+  for (int i = 0;  i < context->num_workers;  i++) {
+	check_thread_rtn("join", pthread_join(context->workers[i].thread, NULL));
+	free(context->workers[i].scratch.pattern_counts);
+	hit_list_destroy(&context->workers[i].scratch.hits);
+  }
+  pthread_mutex_destroy(&context->mutex);
+  pthread_cond_destroy(&context->work_cond);
+  free(context->workers);
+  free(context);
+}
+
+/* Queue a search of start positions [begin, end) of 'fasta' for 'query' and
+ * return at once; search_wait() collects the results. 'base_offset' is added
+ * to printed match offsets.
+ */
+search_job_t *
+search_submit(search_context_t *context, const query_t *query, fasta_t *fasta,
+			  long begin, long end, long base_offset)
+{
+  search_job_t *job = calloc(1, sizeof(search_job_t));
+  job->query = query;
+  job->fasta = fasta;
+  job->begin = begin;
+  job->end = end > begin ? end : begin;
+  job->base_offset = base_offset;
+  job->pattern_counts = calloc(query->num_patterns, sizeof(long));
+  check_thread_rtn("cond init", pthread_cond_init(&job->done_cond, NULL));
+  if (job->end == job->begin) {
+	job->done = 1;
+	return job;
+  }
+
+  job->queued = 1;
+  pthread_mutex_lock(&context->mutex);
+  if (context->tail) {
+	context->tail->next = job;
+  } else {
+	context->head = job;
+  }
+  context->tail = job;
+  pthread_cond_broadcast(&context->work_cond);
+  pthread_mutex_unlock(&context->mutex);
+  return job;
+}
+
+/* Wait for a submitted job to finish; its counts are final on return. */
+void
+search_wait(search_context_t *context, search_job_t *job)
+{
+  pthread_mutex_lock(&context->mutex);
+  while (!job->done) {
+	pthread_cond_wait(&job->done_cond, &context->mutex);
+  }
+  pthread_mutex_unlock(&context->mutex);
+}
+
+/* Free a finished job. */
+void
+search_job_destroy(search_job_t *job)
+{
+  pthread_cond_destroy(&job->done_cond);
+  free(job->pattern_counts);
+  hit_list_destroy(&job->hits);
+  free(job);
+}
+
+/* Totals over one or more finished search jobs. */
+typedef struct {
+  long match_count;
+  long trial_count;
+  long *pattern_counts;			/* Matches of each of query->patterns */
+} search_totals_t;
+
+/* Output is formatted into a buffer and written out a buffer at a time. */
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+/* Order hits by offset, then by pattern. */
+int
+compare_hits(const void *a, const void *b)
+{
+  const hit_t *x = a;
+  const hit_t *y = b;
+  if (x->offset != y->offset) {
+	return x->offset < y->offset ? -1 : 1;
+  }
+  return x->pattern - y->pattern;
+}
+
+/* Copy 'length' bases at 'offset' of a FASTA structure, text or packed, to
+ * 'buffer'.
+ */
+void
+copy_bases(fasta_t *fasta, long offset, long length, char *buffer)
+{
+  if (fasta->packed) {
+	fasta_unpack(fasta, offset, length, buffer);
+  } else {
+	memcpy(buffer, fasta->sequence + offset, length);
+  }
+}
+
+/* Print a finished job's hits in order of position. Each is shown in
+ * brackets with up to 8 bases of context either side, not running past
+ * either end of its contig or of the job's data, followed by its position
+ * within its contig and the contig's name (or its offset, if there is no
+ * contig table), its strand for a two-strand search, and its edits or
+ * mismatches for an approximate one. Hits found with edits are placed by
+ * their best end. The lines are formatted into a buffer and written out a
+ * buffer at a time, rather than with a printf() per byte.
+ */
+void
+hits_print(search_job_t *job)
+{
+  const int padding_bytes = 8;
+  const query_t *query = job->query;
+  fasta_t *fasta = job->fasta;
+  const contig_table_t *contigs = &fasta->contigs;
+  long base_offset = job->base_offset;
+  hit_list_t *hits = &job->hits;
+
+  qsort(hits->entries, hits->count, sizeof(hit_t), compare_hits);
+  long size = OUTPUT_BUFFER_SIZE;
+  char *buffer = malloc(size);
+  long used = 0;
+  for (long h = 0;  h < hits->count;  h++) {
+	const hit_t *hit = &hits->entries[h];
+	long start = hit->offset - base_offset;
+	long low = 0;
+	long high = fasta->cur_length;
+	long c = contig_find(contigs, hit->offset);
+	const char *name = NULL;
+	if (c >= 0) {
+	  const contig_t *contig = &contigs->entries[c];
+	  if (contig->start - base_offset > low) {
+		low = contig->start - base_offset;
+	  }
+	  if (contig->start + contig->length - base_offset < high) {
+		high = contig->start + contig->length - base_offset;
+	  }
+	  name = contigs->names + contig->name;
+	}
+	long first = start - padding_bytes > low ? start - padding_bytes : low;
+	long stop = start + hit->length;
+	long last = stop + padding_bytes < high ? stop + padding_bytes : high;
+
+	long room = 2 * padding_bytes + hit->length + (name ? strlen(name) : 0) + 64;
+	if (used + room > size) {
+	  fwrite(buffer, 1, used, stdout);
+	  used = 0;
+	  if (room > size) {
+		size = room;
+		buffer = realloc(buffer, size);
+	  }
+	}
+	char *out = buffer + used;
+	memset(out, ' ', padding_bytes - (start - first));
+	out += padding_bytes - (start - first);
+	copy_bases(fasta, first, start - first, out);
+	out += start - first;
+	*out++ = '[';
+	copy_bases(fasta, start, hit->length, out);
+	out += hit->length;
+	*out++ = ']';
+	copy_bases(fasta, stop, last - stop, out);
+	out += last - stop;
+	memset(out, ' ', padding_bytes - (last - stop));
+	out += padding_bytes - (last - stop);
+
+	long position = query->myers ? hit->offset + hit->length - 1 : hit->offset;
+	if (name) {
+	  out += sprintf(out, "%15ld %s", position - contigs->entries[c].start, name);
+	} else {
+	  out += sprintf(out, "%15ld", position);
+	}
+	char strand = query_strand(query, hit->pattern);
+	if (strand) {
+	  out += sprintf(out, " %c", strand);
+	}
+	if (hit->distance >= 0 && query->myers) {
+	  out += sprintf(out, " %d edit%s", hit->distance, hit->distance == 1 ? "" : "s");
+	} else if (hit->distance >= 0) {
+	  out += sprintf(out, " %d mismatch%s", hit->distance, hit->distance == 1 ? "" : "es");
+	}
+	*out++ = '\n';
+	used = out - buffer;
+  }
+  fwrite(buffer, 1, used, stdout);
+  free(buffer);
+}
+
+/* Print a finished job's hits, add its results to 'totals' and free the
+ * job. Jobs over a sequence in pieces are collected in sequence order, so
+ * the hits come out in order overall.
+ */
+void
+search_collect(search_job_t *job, search_totals_t *totals)
+{
+  if (job->hits.count > 0) {
+	hits_print(job);
+  }
+  totals->match_count += job->match_count;
+  totals->trial_count += job->trial_count;
+  for (int i = 0;  i < job->query->num_patterns;  i++) {
+	totals->pattern_counts[i] += job->pattern_counts[i];
+  }
+  search_job_destroy(job);
+}
+
+/* A window of sequence data from the streaming reader, searched as its own
+ * job. Each window starts with the last max_length-1 bytes of the window
+ * before it, so matches that straddle two windows are still found.
+ */
+typedef struct {
+  fasta_t text;					/* Overlap plus fresh data */
+  long offset;					/* Offset of the window in the whole sequence */
+  search_job_t *job;			/* Search of the window, or NULL if idle */
+} window_t;
+
+/* Search the FASTA files for 'query' without ever holding the whole sequence
+ * in memory. The calling thread decompresses and strips the files into a
+ * ring of 'stream_window'-byte windows, handing each to the context's
+ * workers as soon as it fills. Memory use is bounded by the number of windows
+ * rather than the size of the genome, and loading overlaps searching.
+ */
+void
+stream_search(search_context_t *context, const query_t *query, int num_files,
+			  char **file_names, search_totals_t *totals)
+{
+  long overlap = query->max_length - 1;
+  int num_windows = 2 * context->num_workers;
+  window_t windows[num_windows];
+  for (int i = 0;  i < num_windows;  i++) {
+	window_t *window = &windows[i];
+	memset(&window->text, 0, sizeof(fasta_t));
+	window->text.sequence = window->text.seq_ptr = malloc(stream_window + overlap);
+	window->text.max_length = stream_window + overlap;
+	window->offset = 0;
+	window->job = NULL;
+  }
+
+  /* Strip annotation lines and newlines as the text streams past; lines
+   * (and annotations) can span reads, and data can span windows. Each window
+   * gets the contigs it overlaps, so no match runs from one into the next.
+   */
+  char *read_buffer = malloc(ONE_MEGA);
+  char header[line_buffer_length];
+  long header_length = 0;
+  int idx = 0;
+  window_t *window = &windows[0];
+  for (int f = 0;  f < num_files;  f++) {
+	gzFile gzfp = gzopen(file_names[f], "rb");
+	if (!gzfp) {
+	  fprintf(stderr, "Can't open '%s' for reading\n", file_names[f]);
+	  exit(1);
+	}
+	printf(" LOADING %s\n", file_names[f]);
+	gzbuffer(gzfp, ONE_MEGA);
+	contig_add(&window->text.contigs, file_names[f], strlen(file_names[f]),
+			   window->offset + window->text.cur_length);
+
+	int at_line_start = 1;
+	int in_annotation = 0;
+	int got;
+	while ((got = gzread(gzfp, read_buffer, ONE_MEGA)) > 0) {
+	  load_bytes += got;
+	  const char *p = read_buffer;
+	  const char *read_end = read_buffer + got;
+	  while (p < read_end) {
+		if (at_line_start && *p == '>') {
+		  in_annotation = 1;
+		  header_length = 0;
+		}
+		at_line_start = 0;
+		const char *eol = memchr(p, '\n', read_end - p);
+		const char *stop = eol ? eol : read_end;
+		if (in_annotation) {
+		  long length = stop - p < line_buffer_length - header_length ?
+			stop - p : line_buffer_length - header_length;
+		  memcpy(header + header_length, p, length);
+		  header_length += length;
+		  if (eol) {
+			contig_add_header(&window->text.contigs, header, header_length,
+							  window->offset + window->text.cur_length);
+		  }
+		}
+		while (!in_annotation && p < stop) {
+		  long room = window->text.max_length - window->text.cur_length;
+		  long length = stop - p < room ? stop - p : room;
+		  fasta_append_line(&window->text, p, length);
+		  p += length;
+		  if (window->text.cur_length < window->text.max_length) {
+			continue;
+		  }
+
+		  /* Starts in the last 'overlap' bytes are searched as part of the
+		   * next window, which begins with those bytes. Approximate hits
+		   * are searched by end instead, so a window leaves its first
+		   * 'overlap' bytes to the one before and warms up on them.
+		   */
+		  contig_finish(&window->text.contigs, window->offset + window->text.cur_length);
+		  if (query->myers) {
+			window->job = search_submit(context, query, &window->text,
+										window->offset > 0 ? overlap : 0,
+										window->text.cur_length, window->offset);
+		  } else {
+			window->job = search_submit(context, query, &window->text, 0,
+										window->text.cur_length - overlap, window->offset);
+		  }
+		  window_t *next_window = &windows[(idx + 1) % num_windows];
+		  if (next_window->job) {
+			search_wait(context, next_window->job);
+			search_collect(next_window->job, totals);
+			next_window->job = NULL;
+		  }
+		  memcpy(next_window->text.sequence,
+				 window->text.sequence + window->text.cur_length - overlap, overlap);
+		  next_window->text.seq_ptr = next_window->text.sequence + overlap;
+		  next_window->text.cur_length = overlap;
+		  next_window->offset = window->offset + window->text.cur_length - overlap;
+		  contig_carry(&next_window->text.contigs, &window->text.contigs, next_window->offset);
+		  idx = (idx + 1) % num_windows;
+		  window = next_window;
+		}
+		if (eol) {
+		  in_annotation = 0;
+		  at_line_start = 1;
+		}
+		p = eol ? eol + 1 : read_end;
+	  }
+	}
+	if (got < 0) {
+	  fprintf(stderr, "Error reading '%s'\n", file_names[f]);
+	  exit(1);
+	}
+	gzclose(gzfp);
+  }
+  free(read_buffer);
+
+  /* The final window searches every start; match_range() drops those with
+   * no room for a pattern.
+   */
+  contig_finish(&window->text.contigs, window->offset + window->text.cur_length);
+  window->job = search_submit(context, query, &window->text,
+							  query->myers && window->offset > 0 ? overlap : 0,
+							  window->text.cur_length, window->offset);
+  for (int i = 1;  i <= num_windows;  i++) {
+	window = &windows[(idx + i) % num_windows];
+	if (window->job) {
+	  search_wait(context, window->job);
+	  search_collect(window->job, totals);
+	}
+  }
+  for (int i = 0;  i < num_windows;  i++) {
+	free(windows[i].text.sequence);
+	contig_destroy(&windows[i].text.contigs);
+  }
+}
+
+/* Induced sorting (SA-IS) suffix array construction, after Nong, Zhang and
+ * Chan. 's' holds 'n' symbols in [0, max_symbol], either bytes ('symbol_size'
+ * 1) or longs, and must end with a unique 0 sentinel. Reduced problems are
+ * solved recursively in the tail of 'sa', so apart from the type bits and
+ * buckets no memory beyond the suffix array itself is needed.
+ */
+#define SAIS_SYMBOL(i) (symbol_size == 1 ? ((const unsigned char *)s)[i] : ((const long *)s)[i])
+#define SAIS_TYPE(i) ((types[(i) / 8] >> ((i) % 8)) & 1)
+#define SAIS_SET_TYPE(i, t) (types[(i) / 8] = (t) ? types[(i) / 8] | (1 << ((i) % 8)) : \
+							 types[(i) / 8] & ~(1 << ((i) % 8)))
+#define SAIS_IS_LMS(i) ((i) > 0 && SAIS_TYPE(i) && !SAIS_TYPE((i) - 1))
+
+/* Find the start (or end, if 'ends') of each symbol's bucket. */
+void
+sais_buckets(const void *s, long *buckets, long n, long max_symbol, int symbol_size, int ends)
+{
+  long sum = 0;
+  memset(buckets, 0, (max_symbol + 1) * sizeof(long));
+  for (long i = 0;  i < n;  i++) {
+	buckets[SAIS_SYMBOL(i)]++;
+  }
+  for (long c = 0;  c <= max_symbol;  c++) {
+	sum += buckets[c];
+	buckets[c] = ends ? sum : sum - buckets[c];
+  }
+}
+
+/* Induce the order of L-type then S-type suffixes from those already placed. */
+void
+sais_induce(const unsigned char *types, long *sa, const void *s, long *buckets,
+			long n, long max_symbol, int symbol_size)
+{
+  sais_buckets(s, buckets, n, max_symbol, symbol_size, 0);
+  for (long i = 0;  i < n;  i++) {
+	long j = sa[i] - 1;
+	if (j >= 0 && !SAIS_TYPE(j)) {
+	  sa[buckets[SAIS_SYMBOL(j)]++] = j;
+	}
+  }
+  sais_buckets(s, buckets, n, max_symbol, symbol_size, 1);
+  for (long i = n - 1;  i >= 0;  i--) {
+	long j = sa[i] - 1;
+	if (j >= 0 && SAIS_TYPE(j)) {
+	  sa[--buckets[SAIS_SYMBOL(j)]] = j;
+	}
+  }
+}
+
+void
+sais(const void *s, long *sa, long n, long max_symbol, int symbol_size, int level)
+{
+  unsigned char *types = calloc(n / 8 + 1, 1);
+  long *buckets = malloc((max_symbol + 1) * sizeof(long));
+
+  /* Classify each suffix as S-type (1) or L-type (0). */
+  SAIS_SET_TYPE(n - 2, 0);
+  SAIS_SET_TYPE(n - 1, 1);
+  for (long i = n - 3;  i >= 0;  i--) {
+	SAIS_SET_TYPE(i, SAIS_SYMBOL(i) < SAIS_SYMBOL(i + 1) ||
+				  (SAIS_SYMBOL(i) == SAIS_SYMBOL(i + 1) && SAIS_TYPE(i + 1)));
+  }
+
+  /* Sort the LMS substrings by inducing from their bucket ends. */
+  sais_buckets(s, buckets, n, max_symbol, symbol_size, 1);
+  for (long i = 0;  i < n;  i++) {
+	sa[i] = -1;
+  }
+  for (long i = 1;  i < n;  i++) {
+	if (SAIS_IS_LMS(i)) {
+	  sa[--buckets[SAIS_SYMBOL(i)]] = i;
+	}
+  }
+  sais_induce(types, sa, s, buckets, n, max_symbol, symbol_size);
+
+  /* Compact the sorted LMS substrings into the head of 'sa' and name them. */
+  long n1 = 0;
+  for (long i = 0;  i < n;  i++) {
+	if (SAIS_IS_LMS(sa[i])) {
+	  sa[n1++] = sa[i];
+	}
+  }
+  for (long i = n1;  i < n;  i++) {
+	sa[i] = -1;
+  }
+  long name = 0;
+  long prev = -1;
+  for (long i = 0;  i < n1;  i++) {
+	long pos = sa[i];
+	int diff = 0;
+	for (long d = 0;  d < n;  d++) {
+	  if (prev == -1 || SAIS_SYMBOL(pos + d) != SAIS_SYMBOL(prev + d) ||
+		  SAIS_TYPE(pos + d) != SAIS_TYPE(prev + d)) {
+		diff = 1;
+		break;
+	  } else if (d > 0 && (SAIS_IS_LMS(pos + d) || SAIS_IS_LMS(prev + d))) {
+		break;
+	  }
+	}
+	if (diff) {
+	  name++;
+	  prev = pos;
+	}
+	sa[n1 + pos / 2] = name - 1;
+  }
+  for (long i = n - 1, j = n - 1;  i >= n1;  i--) {
+	if (sa[i] >= 0) {
+	  sa[j--] = sa[i];
+	}
+  }
+
+  /* Sort the reduced string, recursing if the names aren't yet unique. */
+  long *sa1 = sa;
+  long *s1 = sa + n - n1;
+  if (name < n1) {
+	sais(s1, sa1, n1, name - 1, sizeof(long), level + 1);
+  } else {
+	for (long i = 0;  i < n1;  i++) {
+	  sa1[s1[i]] = i;
+	}
+  }
+
+  /* Induce the full suffix array from the sorted LMS suffixes. */
+  sais_buckets(s, buckets, n, max_symbol, symbol_size, 1);
+  for (long i = 1, j = 0;  i < n;  i++) {
+	if (SAIS_IS_LMS(i)) {
+	  s1[j++] = i;
+	}
+  }
+  for (long i = 0;  i < n1;  i++) {
+	sa1[i] = s1[sa1[i]];
+  }
+  for (long i = n1;  i < n;  i++) {
+	sa[i] = -1;
+  }
+  for (long i = n1 - 1;  i >= 0;  i--) {
+	long j = sa[i];
+	sa[i] = -1;
+	if (level == 0 && i == 0) {
+	  sa[0] = n - 1;
+	} else {
+	  sa[--buckets[SAIS_SYMBOL(j)]] = j;
+	}
+  }
+  sais_induce(types, sa, s, buckets, n, max_symbol, symbol_size);
+
+  free(buckets);
+  free(types);
+}
+
+/* FM-index over the FASTA data: the Burrows-Wheeler transform of the sequence
+ * plus a sentinel, with a FM_SEPARATOR byte between contigs so that no match
+ * can span two of them, occurrence counts checkpointed every FM_OCC_INTERVAL
+ * rows, and the suffix array sampled at every FM_SA_INTERVAL'th text
+ * position.
+ * Counting a pattern takes strlen(pattern) steps of backward search, however
+ * long the genome; locating each match takes at most FM_SA_INTERVAL more.
+ * The index file is the header followed by the arrays, each padded to 8
+ * bytes, and the contig table, so it can be mapped and used without any
+ * parsing.
+ */
+#define FM_MAGIC "PSGFM02"
+#define FM_SEPARATOR '\n'
+#define FM_OCC_INTERVAL 128
+#define FM_SA_INTERVAL 32
+
 typedef struct {
-  char *sequence;				/* Entire sequence */
-  char *seq_ptr;				/* Next location to store data */
-  long max_length;				/* Max length allocated */
-  long cur_length;				/* Current length */
-} fasta_t;
+  char magic[8];
+  long length;					/* Rows; the sequence length plus one */
+  long primary;					/* Row whose BWT symbol is the sentinel */
+  long num_samples;				/* Sampled suffix array entries */
+  long sigma;					/* Symbols, counting the sentinel as 0 */
+  long first_row[257];			/* First row starting with each symbol */
+  unsigned char symbol[256];	/* Symbol for each byte, 0 if absent */
+  long num_contigs;				/* Entries in the contig table */
+  long names_length;			/* Bytes of contig names */
+} fm_header_t;
 
-/* Global variables */
-char *pattern = NULL;
-int num_threads = 1;
-pthread_mutex_t shared_counter_mutex;
-fasta_t *fasta = NULL;
-long match_count = 0;
-long trial_count = 0;
-long chunk_size = 0;
+typedef struct {
+  const fm_header_t *header;
+  const unsigned char *bwt;		/* Symbol preceding each row's suffix */
+  const long *occ;				/* Checkpointed symbol counts */
+  const uint64_t *sampled;		/* Bit set for rows with a sample */
+  const long *sampled_rank;		/* Set bits before each word of 'sampled' */
+  const long *samples;			/* Suffix array at sampled rows */
+  contig_table_t contigs;		/* Contigs, in sequence offsets */
+  void *map;					/* Mapping of the whole index file */
+  long map_length;
+} fm_index_t;
 
-/* Create a FASTA object; allocates memory on the heap */
-fasta_t *
-fasta_create(long max_length)
+/* Round 'length' up to a multiple of 8 bytes. */
+long
+fm_pad(long length)
 {
-  if (verbose) {
-	printf("Allocate %ld bytes\n", max_length);
-  }
-  fasta_t *new = malloc(sizeof(fasta_t));
-  new->sequence = new->seq_ptr = malloc(max_length);
-  new->max_length = max_length;
-  new->cur_length = 0;
-  return new;
+  return (length + 7) & ~7L;
 }
 
-/* Destroy a FASTA object; deallocates memory. */
+/* Point the arrays of an FM-index at their places following the header. */
 void
-fasta_destroy(fasta_t *old)
+fm_layout(fm_index_t *fm, void *base)
 {
-  free(old->sequence);
-  free(old);
+  const fm_header_t *h = base;
+  long words = (h->length + 63) / 64;
+  char *p = (char *)base + fm_pad(sizeof(fm_header_t));
+  fm->header = h;
+  fm->bwt = (const unsigned char *)p;
+  p += fm_pad(h->length);
+  fm->occ = (const long *)p;
+  p += (h->length / FM_OCC_INTERVAL + 1) * h->sigma * sizeof(long);
+  fm->sampled = (const uint64_t *)p;
+  p += words * sizeof(uint64_t);
+  fm->sampled_rank = (const long *)p;
+  p += words * sizeof(long);
+  fm->samples = (const long *)p;
+  p += h->num_samples * sizeof(long);
+  contig_load(&fm->contigs, p, h->num_contigs, h->names_length);
 }
 
-/* Read a FASTA file into a FASTA structure. Can be called multiple times and
- * will append new data to whatever is already in existing structure. For
- * example, can read multiple chromosome files into a single FASTA
- * structure. Will crater on attempts to read more data from file than will fit
- * in allocated FASTA structure. Works with both .g>SEQUEN and flat text files (but
- * prefer the zipped version to save disk space!).
- */
+/* Return the size in bytes of an FM-index file. */
+long
+fm_file_length(const fm_header_t *h)
+{
+  long words = (h->length + 63) / 64;
+  return fm_pad(sizeof(fm_header_t)) + fm_pad(h->length) +
+	(h->length / FM_OCC_INTERVAL + 1) * h->sigma * sizeof(long) +
+	words * (sizeof(uint64_t) + sizeof(long)) + h->num_samples * sizeof(long) +
+	h->num_contigs * sizeof(contig_t) + h->names_length;
+}
+
+/* Build an FM-index of the FASTA data and write it to 'file_name'. */
 void
-fasta_read_file(char *file_name, fasta_t *fasta)
+fm_build(fasta_t *fasta, char *file_name)
 {
-  gzFile gzfp = gzopen(file_name, "rb");
-  if (!gzfp) {
-	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
-	exit(1);
+  /* Join the contigs with separators. */
+  const contig_table_t *contigs = &fasta->contigs;
+  long num_separators = contigs->count > 1 ? contigs->count - 1 : 0;
+  long n = fasta->cur_length + num_separators + 1;
+  unsigned char *seq = malloc(n);
+  for (long c = 0, i = 0;  c <= num_separators;  c++) {
+	long start = c < contigs->count ? contigs->entries[c].start : 0;
+	long length = c < contigs->count ? contigs->entries[c].length : fasta->cur_length;
+	if (c > 0) {
+	  seq[i++] = FM_SEPARATOR;
+	}
+	memcpy(seq + i, fasta->sequence + start, length);
+	i += length;
   }
-  printf(" LOADING %s\n", file_name);
-  
-  /* Reads one line at a time from the FASTA file. */
-  char line_buffer[line_buffer_length];
-  int lines_kept = 0;
-  int lines_skipped = 0;
-  while ((gzgets(gzfp, line_buffer, line_buffer_length) != NULL)) {
-	char *line_ptr = line_buffer;
-	if (line_buffer[0] == '>') {
-	  /* Line contains text annotation; skip it. */
-	  lines_skipped++;
-	} else {
-	  /* Valid data; copy all ACGT data from line buffer. */
-	  lines_kept++;
-	  while (*line_ptr != '\n') {
-		*fasta->seq_ptr++ = *line_ptr++;
-		fasta->cur_length++;
-	  }
+
+  /* Number the bytes that occur, in byte order, from 1; 0 is the sentinel. */
+  fm_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FM_MAGIC, sizeof(header.magic));
+  header.length = n;
+  long byte_counts[256] = { 0 };
+  for (long i = 0;  i < n - 1;  i++) {
+	byte_counts[seq[i]]++;
+  }
+  header.sigma = 1;
+  for (int c = 0;  c < 256;  c++) {
+	if (byte_counts[c]) {
+	  header.symbol[c] = header.sigma++;
 	}
-	if (fasta->cur_length + line_buffer_length > fasta->max_length) {
-	  fprintf(stderr, "Read %ld bytes; fasta buffer too small (%ld bytes)\n",
-			  fasta->cur_length, fasta->max_length);
-	  exit(1);
+  }
+  header.num_contigs = contigs->count;
+  header.names_length = contigs->names_length;
+  header.first_row[1] = 1;
+  for (int c = 0;  c < 256;  c++) {
+	if (byte_counts[c]) {
+	  header.first_row[header.symbol[c] + 1] = header.first_row[header.symbol[c]] + byte_counts[c];
 	}
   }
 
+  unsigned char *text = malloc(n);
+  for (long i = 0;  i < n - 1;  i++) {
+	text[i] = header.symbol[seq[i]];
+  }
+  text[n - 1] = 0;
+  free(seq);
+
+  double start_time = now();
+  long *sa = malloc(n * sizeof(long));
+  sais(text, sa, n, header.sigma - 1, 1, 0);
   if (verbose) {
-	printf("%s: %d lines skipped, %d lines kept, %ld total bytes\n",
-		   file_name, lines_skipped, lines_kept, fasta->cur_length);
+	printf("Suffix array of %ld rows took %5.3f seconds\n", n, now() - start_time);
   }
-  
-  gzclose(gzfp);
+
+  /* Derive the BWT, occurrence checkpoints and suffix array samples. */
+  for (long i = 0;  i < n;  i++) {
+	if (sa[i] % FM_SA_INTERVAL == 0) {
+	  header.num_samples++;
+	}
+  }
+  long file_length = fm_file_length(&header);
+  char *image = calloc(file_length, 1);
+  memcpy(image, &header, sizeof(header));
+  fm_index_t fm;
+  fm_layout(&fm, image);
+  unsigned char *bwt = (unsigned char *)fm.bwt;
+  long *occ = (long *)fm.occ;
+  uint64_t *sampled = (uint64_t *)fm.sampled;
+  long *sampled_rank = (long *)fm.sampled_rank;
+  long *samples = (long *)fm.samples;
+
+  long counts[256] = { 0 };
+  long num_samples = 0;
+  for (long i = 0;  i < n;  i++) {
+	if (i % FM_OCC_INTERVAL == 0) {
+	  memcpy(&occ[i / FM_OCC_INTERVAL * header.sigma], counts, header.sigma * sizeof(long));
+	}
+	if (i % 64 == 0) {
+	  sampled_rank[i / 64] = num_samples;
+	}
+	if (sa[i] == 0) {
+	  bwt[i] = 0;
+	  ((fm_header_t *)image)->primary = i;
+	} else {
+	  bwt[i] = text[sa[i] - 1];
+	}
+	counts[bwt[i]]++;
+	if (sa[i] % FM_SA_INTERVAL == 0) {
+	  sampled[i / 64] |= (uint64_t)1 << (i % 64);
+	  samples[num_samples++] = sa[i];
+	}
+  }
+  if (n % FM_OCC_INTERVAL == 0) {
+	memcpy(&occ[n / FM_OCC_INTERVAL * header.sigma], counts, header.sigma * sizeof(long));
+  }
+  free(sa);
+  free(text);
+  char *stored = (char *)fm.samples + header.num_samples * sizeof(long);
+  memcpy(stored, contigs->entries, contigs->count * sizeof(contig_t));
+  memcpy(stored + contigs->count * sizeof(contig_t), contigs->names, contigs->names_length);
+
+  FILE *fp = fopen(file_name, "wb");
+  if (!fp || fwrite(image, 1, file_length, fp) != (size_t)file_length || fclose(fp) != 0) {
+	fprintf(stderr, "Can't write index '%s'\n", file_name);
+	exit(1);
+  }
+  free(image);
+
+  printf(" INDEXED %ld bytes into %s (%ld bytes) in %5.3f seconds\n",
+		 fasta->cur_length, file_name, file_length, now() - start_time);
 }
 
-/* Return the current time. */
-double
-now(void)
+/* Map an FM-index file written by fm_build(). */
+fm_index_t *
+fm_load(char *file_name)
 {
-  struct timespec current_time;
-  clock_gettime(CLOCK_REALTIME, &current_time);
-  return current_time.tv_sec + (current_time.tv_nsec / ONE_BILLION);
+  int fd = open(file_name, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+	fprintf(stderr, "Can't open '%s' for reading\n", file_name);
+	exit(1);
+  }
+  void *map = st.st_size >= (long)sizeof(fm_header_t) ?
+	mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED || memcmp(map, FM_MAGIC, sizeof(FM_MAGIC)) != 0 ||
+	  fm_file_length(map) != st.st_size) {
+	fprintf(stderr, "'%s' is not a genome index\n", file_name);
+	exit(1);
+  }
+
+  fm_index_t *fm = malloc(sizeof(fm_index_t));
+  fm_layout(fm, map);
+  fm->map = map;
+  fm->map_length = st.st_size;
+  return fm;
 }
 
-/* Return the smaller of two pointers. */
-const char *
-min(const char *a, const char *b)
+/* Unmap an FM-index. */
+void
+fm_destroy(fm_index_t *fm)
 {
-  return a < b ? a : b;
+  munmap(fm->map, fm->map_length);
+  free(fm);
 }
 
-/* Return the larger of two pointers. */
-const char *
-max(const char *a, const char *b)
+/* Return the number of times 'symbol' occurs in the BWT before 'row'. */
+long
+fm_occ(const fm_index_t *fm, int symbol, long row)
 {
-  return a > b ? a : b;
+  long block = row / FM_OCC_INTERVAL;
+  long count = fm->occ[block * fm->header->sigma + symbol];
+  for (long i = block * FM_OCC_INTERVAL;  i < row;  i++) {
+	count += fm->bwt[i] == symbol;
+  }
+  return count;
 }
 
-/* Clamp 'value' to be in the range ['low' .. 'high'] */
-const char *
-clamp(const char *value, const char *low, const char *high)
+/* Find the rows [*low, *high) whose suffixes start with 'text' by backward
+ * search; the count of matches is *high - *low.
+ */
+void
+fm_find(const fm_index_t *fm, const char *text, long *low, long *high)
 {
-  if (low >= high) {
-	fprintf(stderr, "Bogus bounds [%p, %p]\n", low, high);
-	exit(1);
+  *low = 0;
+  *high = fm->header->length;
+  for (long i = strlen(text) - 1;  i >= 0 && *low < *high;  i--) {
+	int symbol = fm->header->symbol[(unsigned char)text[i]];
+	if (symbol == 0) {
+	  *low = *high = 0;
+	  break;
+	}
+	*low = fm->header->first_row[symbol] + fm_occ(fm, symbol, *low);
+	*high = fm->header->first_row[symbol] + fm_occ(fm, symbol, *high);
+  }
+}
+
+/* Return the sequence offset of the suffix at 'row', stepping back through
+ * the text with LF-mapping until reaching a sampled row.
+ */
+long
+fm_locate(const fm_index_t *fm, long row)
+{
+  long steps = 0;
+  while (!((fm->sampled[row / 64] >> (row % 64)) & 1)) {
+	int symbol = fm->bwt[row];
+	row = fm->header->first_row[symbol] + fm_occ(fm, symbol, row);
+	steps++;
   }
+  uint64_t below = fm->sampled[row / 64] & (((uint64_t)1 << (row % 64)) - 1);
+  return fm->samples[fm->sampled_rank[row / 64] + __builtin_popcountll(below)] + steps;
+}
 
-  return min(max(value, low), high);
+/* Compare two offsets for qsort(). */
+int
+compare_offsets(const void *a, const void *b)
+{
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return x < y ? -1 : x > y;
 }
 
-/* Print 'n' padding characters to pretty-up the output. */
-void
-print_padding(const int n)
+/* Count (and if 'locate', locate) one plain pattern with an FM-index. */
+long
+fm_search_text(const fm_index_t *fm, const char *text, int locate)
+{
+  long low;
+  long high;
+  fm_find(fm, text, &low, &high);
+  if (locate && high > low) {
+	long *offsets = malloc((high - low) * sizeof(long));
+	for (long row = low;  row < high;  row++) {
+	  offsets[row - low] = fm_locate(fm, row);
+	}
+	qsort(offsets, high - low, sizeof(long), compare_offsets);
+	/* Contig c starts c separators further along in the indexed text. */
+	const contig_table_t *contigs = &fm->contigs;
+	long c = 0;
+	for (long i = 0;  i < high - low;  i++) {
+	  while (c + 1 < contigs->count && contigs->entries[c + 1].start + c + 1 <= offsets[i]) {
+		c++;
+	  }
+	  if (contigs->count) {
+		printf("%15ld %s %s\n", offsets[i] - c - contigs->entries[c].start,
+			   contigs->names + contigs->entries[c].name, text);
+	  } else {
+		printf("%15ld %s\n", offsets[i], text);
+	  }
+	}
+	free(offsets);
+  }
+  return high - low;
+}
+
+/* Count (and with -v, locate) one pattern with an FM-index; with -i, as
+ * the sum over the plain patterns it stands for.
+ */
+long
+fm_search(const fm_index_t *fm, const char *text, const query_options_t *options)
 {
-  for (int i = 0;  i < n;  i++) {
-	printf(" ");
+  if (!options->iupac) {
+	return fm_search_text(fm, text, options->locate);
+  }
+  int num_variants;
+  char **variants = iupac_expand(text, &num_variants);
+  long count = 0;
+  for (int v = 0;  v < num_variants;  v++) {
+	count += fm_search_text(fm, variants[v], options->locate);
+	free(variants[v]);
   }
+  free(variants);
+  return count;
 }
 
-/* Print 'length' bytes starting at 'current' from within the current data in
- * a FASTA structure. Also prints 'padding_bytes' bytes before and after the
- * range of values for context, as well as the offset into the sequence. Takes
- * care not to blow past either end of the sequence data in the FASTA
- * structure.
+/* Print the pattern(s) searched for and how often they matched. With -r,
+ * 'reverse' maps each pattern to the count of its reverse complement (see
+ * strand_patterns()), and each count is split by strand.
  */
 void
-bytes_around(fasta_t *fasta, char *current, int length)
+report_matches(char **patterns, int num_patterns, const int *reverse,
+			   const search_totals_t *totals)
 {
-  const int padding_bytes = 8;
-  const char *fasta_last = fasta->sequence + fasta->cur_length;
+  if (pattern_file) {
+	printf("PATTERNS %d from %s\n", num_patterns, pattern_file);
+  } else {
+	printf(" PATTERN %s\n", pattern);
+  }
+  printf("   MATCH %ld time%s\n", totals->match_count, totals->match_count == 1 ? "" : "s");
+  if (reverse && !pattern_file) {
+	long reverse_count = reverse[0] >= 0 ? totals->pattern_counts[reverse[0]] : 0;
+	printf("  STRAND %ld forward, %ld reverse\n",
+		   totals->match_count - reverse_count, reverse_count);
+  }
+  for (int i = 0;  i < num_patterns;  i++) {
+	if (reverse) {
+	  long reverse_count = reverse[i] >= 0 ? totals->pattern_counts[reverse[i]] : 0;
+	  printf("%15ld %s (%ld forward, %ld reverse)\n",
+			 totals->pattern_counts[i] + reverse_count, patterns[i],
+			 totals->pattern_counts[i], reverse_count);
+	} else {
+	  printf("%15ld %s\n", totals->pattern_counts[i], patterns[i]);
+	}
+  }
+}
+
+/* Server mode: a resident process loads the FASTA data once and answers
+ * queries from clients over a Unix domain socket, so a query costs only its
+ * search. A request is a line with a number of patterns followed by the
+ * patterns, one per line. The reply is a line with the total matches,
+ * positions tried and search time, then one line per pattern with its count.
+ * A client may send any number of requests on one connection. A request for
+ * no patterns or more than SERVE_MAX_PATTERNS ends the connection.
+ */
+#define SERVE_MAX_PATTERNS 1000000
+
+typedef struct {
+  search_context_t *context;
+  fasta_t *fasta;
+  const query_options_t *options;
+  int fd;
+} client_t;
+
+/* Search for a batch of patterns with 'options', adding the results to
+ * 'totals'. On text a batch is one Aho-Corasick job; packed data has no
+ * multi-pattern kernel, so there each pattern is its own job, and the pool
+ * interleaves them. Returns 0 if there's no memory for the batch.
+ */
+int
+serve_request(search_context_t *context, fasta_t *fasta, const query_options_t *options,
+			  char **patterns, int num_patterns, search_totals_t *totals)
+{
+  if (num_patterns > 1 && !fasta->packed) {
+	query_t *query = query_create(NULL, patterns, num_patterns, options);
+	search_job_t *job = search_submit(context, query, fasta, 0, fasta->cur_length, 0);
+	search_wait(context, job);
+	search_collect(job, totals);
+	query_destroy(query);
+	return 1;
+  }
 
-  const char *first = clamp(current - padding_bytes, fasta->sequence, fasta_last);
-  const char *last = clamp(current + length + padding_bytes, fasta->sequence, fasta_last);
+  query_t **queries = malloc(num_patterns * sizeof(query_t *));
+  search_job_t **jobs = malloc(num_patterns * sizeof(search_job_t *));
+  if (!queries || !jobs) {
+	free(queries);
+	free(jobs);
+	return 0;
+  }
+  for (int i = 0;  i < num_patterns;  i++) {
+	queries[i] = query_create(patterns[i], NULL, 0, options);
+	jobs[i] = search_submit(context, queries[i], fasta, 0, fasta->cur_length, 0);
+  }
+  for (int i = 0;  i < num_patterns;  i++) {
+	search_wait(context, jobs[i]);
+	totals->pattern_counts[i] = jobs[i]->match_count;
+	search_collect(jobs[i], totals);
+	query_destroy(queries[i]);
+  }
+  free(queries);
+  free(jobs);
+  return 1;
+}
 
-  print_padding(padding_bytes - (current - first));
+/* Answer one client's requests until it hangs up or sends a bad request. */
+void *
+serve_client(void *ptr)
+{
+  client_t *client = ptr;
+  FILE *in = fdopen(client->fd, "r");
+  FILE *out = fdopen(dup(client->fd), "w");
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t got;
+
+  while (getline(&line, &line_size, in) > 0) {
+	long num_patterns = strtol(line, NULL, 10);
+	if (num_patterns < 1 || num_patterns > SERVE_MAX_PATTERNS) {
+	  break;
+	}
+	char **patterns = calloc(num_patterns, sizeof(char *));
+	if (!patterns) {
+	  break;
+	}
+	int num_read = 0;
+	while (num_read < num_patterns && (got = getline(&line, &line_size, in)) > 0) {
+	  while (got > 0 && (line[got - 1] == '\n' || line[got - 1] == '\r')) {
+		line[--got] = '\0';
+	  }
+	  if (got == 0 || (patterns[num_read] = strdup(line)) == NULL) {
+		break;
+	  }
+	  num_read++;
+	}
 
-  for (const char *p = first;  p < last;  p++) {
-	if (p == current) {
-	  printf("[");
+	search_totals_t totals = { 0, 0, calloc(num_patterns, sizeof(long)) };
+	double start_time = now();
+	int complete = num_read == num_patterns && totals.pattern_counts &&
+	  serve_request(client->context, client->fasta, client->options, patterns, num_patterns,
+					&totals);
+	if (complete) {
+	  fprintf(out, "%ld %ld %f\n", totals.match_count, totals.trial_count, now() - start_time);
+	  for (int i = 0;  i < num_patterns;  i++) {
+		fprintf(out, "%ld\n", totals.pattern_counts[i]);
+	  }
+	  fflush(out);
+	}
+	free(totals.pattern_counts);
+	for (int i = 0;  i < num_read;  i++) {
+	  free(patterns[i]);
 	}
-	printf("%c", *p);
-	if (p == current + length - 1) {
-	  printf("]");
+	free(patterns);
+	if (!complete) {
+	  break;
 	}
   }
 
-  print_padding(padding_bytes - (last - (current + length)));
-  printf("%15ld\n", current - fasta->sequence);
+  free(line);
+  fclose(in);
+  fclose(out);
+  free(client);
+  return (void *)NULL;
 }
 
-/* My parallel implementation of match()
+/* Listen on 'socket_name' and answer clients' queries against 'fasta' with
+ * 'options' and the workers of 'context', each client on its own thread.
+ * Never returns.
  */
-void *
-parallel_match(void *ptr)
+void
+serve(search_context_t *context, fasta_t *fasta, char *socket_name,
+	  const query_options_t *options)
 {
-  int pattern_length = strlen(pattern);
-  char *cur_location = ptr;
-  char *last_location = ptr + chunk_size-1;
-  long local_count = 0;
-  long local_trial = 0;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_name) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "Socket name '%s' too long\n", socket_name);
+	exit(1);
+  }
+  strcpy(addr.sun_path, socket_name);
 
-  while (cur_location <= last_location) {
-	local_trial++;
-	if (strncmp(cur_location, pattern, pattern_length) == 0) {
-	  if (verbose) {
-		bytes_around(fasta, cur_location, pattern_length);
-	  }
-	  local_count++;
+  /* Replace a socket left behind by an earlier server, but nothing else. */
+  struct stat st;
+  if (stat(socket_name, &st) == 0 && S_ISSOCK(st.st_mode)) {
+	unlink(socket_name);
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+	fprintf(stderr, "Can't listen on '%s'\n", socket_name);
+	exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  printf(" SERVING %s\n", socket_name);
+  fflush(stdout);
+
+  while (1) {
+	int client_fd = accept(fd, NULL, NULL);
+	if (client_fd < 0) {
+	  continue;
 	}
-	cur_location++;
+	client_t *client = malloc(sizeof(client_t));
+	client->context = context;
+	client->fasta = fasta;
+	client->options = options;
+	client->fd = client_fd;
+	pthread_t thread;
+	check_thread_rtn("create", pthread_create(&thread, NULL, serve_client, client));
+	pthread_detach(thread);
+  }
+}
+
+/* Send a batch of patterns to the server at 'socket_name' and read back the
+ * results into 'totals'. Returns the server's search time.
+ */
+double
+query_server(char *socket_name, char **patterns, int num_patterns, search_totals_t *totals)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_name, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	fprintf(stderr, "Can't connect to '%s'\n", socket_name);
+	exit(1);
   }
+  if (num_patterns > SERVE_MAX_PATTERNS) {
+	fprintf(stderr, "Can't send more than %d patterns to a server\n", SERVE_MAX_PATTERNS);
+	exit(1);
+  }
+  FILE *fp = fdopen(fd, "r+");
 
-  // mutex stuff! once we have the local count
-  pthread_mutex_lock(&shared_counter_mutex);
-  match_count += local_count;
-  trial_count += local_trial;
-  pthread_mutex_unlock(&shared_counter_mutex);
+  fprintf(fp, "%d\n", num_patterns);
+  for (int i = 0;  i < num_patterns;  i++) {
+	fprintf(fp, "%s\n", patterns[i]);
+  }
+  fflush(fp);
 
-  return (void *)NULL;
+  double search_time;
+  if (fscanf(fp, "%ld %ld %lf", &totals->match_count, &totals->trial_count, &search_time) != 3) {
+	fprintf(stderr, "No reply from '%s'\n", socket_name);
+	exit(1);
+  }
+  for (int i = 0;  i < num_patterns;  i++) {
+	if (fscanf(fp, "%ld", &totals->pattern_counts[i]) != 1) {
+	  fprintf(stderr, "Short reply from '%s'\n", socket_name);
+	  exit(1);
+	}
+  }
+  fclose(fp);
+  return search_time;
 }
 
 /* Print a usage message and exit. */
 void
 usage(char *prog_name)
 {
-  fprintf(stderr, "%s: [-v] -b <B>|-m <MB>|-g <GB> -p <pattern> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-v] [-r] [-i] [-k <edits>] [--engine=<engine>] [-b <B>|-m <MB>|-g <GB>|-s <MB>] -p <pattern>|-P <file> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-v] [-b <B>|-m <MB>|-g <GB>] -S <socket> <fastafile>...\n", prog_name);
+  fprintf(stderr, "%s: [-r] -C <socket> -p <pattern>|-P <file>\n", prog_name);
   fprintf(stderr, "  -v           enable verbose output\n");
-  fprintf(stderr, "  -b <B>       allocate <B> bytes for FASTA data\n");
-  fprintf(stderr, "  -m <MB>      allocate <MB> megabytes for FASTA data\n");
-  fprintf(stderr, "  -g <GB>      allocate <GB> gigabytes for FASTA data\n");
-  fprintf(stderr, "  -p <pattern> pattern for search [required]\n");
+  fprintf(stderr, "  -b <B>       allocate <B> bytes for FASTA data at first\n");
+  fprintf(stderr, "  -m <MB>      allocate <MB> megabytes for FASTA data at first\n");
+  fprintf(stderr, "  -g <GB>      allocate <GB> gigabytes for FASTA data at first\n");
+  fprintf(stderr, "  -s <MB>      stream the data through <MB> megabyte windows\n");
+  fprintf(stderr, "  -n <N>       use <N> threads\n");
+  fprintf(stderr, "  -2           store the sequence 2-bit packed (not with -s, -P, -r, or -k\n");
+  fprintf(stderr, "               without --hamming)\n");
+  fprintf(stderr, "  -p <pattern> pattern for search\n");
+  fprintf(stderr, "  -P <file>    search for every pattern in <file>, one per line\n");
+  fprintf(stderr, "  -r, --both-strands\n");
+  fprintf(stderr, "               also search for the reverse complement of each pattern\n");
+  fprintf(stderr, "  -i, --iupac  treat IUPAC codes in patterns (R, Y, N...) as sets of bases\n");
+  fprintf(stderr, "  -k <edits>   find hits within <edits> mismatches, insertions and deletions\n");
+  fprintf(stderr, "  --hamming    with -k, allow mismatches only\n");
+  fprintf(stderr, "  --engine=shiftor|bndm|auto\n");
+  fprintf(stderr, "               match a single pattern of up to 64 bases with Shift-Or or\n");
+  fprintf(stderr, "               BNDM, or pick the fastest kernel for it (the default)\n");
+  fprintf(stderr, "  --isa=scalar|sse4.2|avx2|avx512\n");
+  fprintf(stderr, "               use no kernels for a wider instruction set than this\n");
+  fprintf(stderr, "  -I <index>   build an FM-index of the FASTA data into <index> and exit\n");
+  fprintf(stderr, "  -X <index>   search the FM-index in <index> instead of FASTA data\n");
+  fprintf(stderr, "  -S <socket>  load the FASTA data once and serve queries on <socket>\n");
+  fprintf(stderr, "  -C <socket>  send the query to the server on <socket>\n");
+  fprintf(stderr, "  -M <segment> publish the FASTA data as shared memory <segment> and exit\n");
+  fprintf(stderr, "  -A <segment> search shared memory <segment> instead of loading FASTA data\n");
+  fprintf(stderr, "  --cache <file>\n");
+  fprintf(stderr, "               load the FASTA data from cache <file>, rebuilding it if stale;\n");
+  fprintf(stderr, "               a cache holds packed (-2) or text data, not both\n");
+  fprintf(stderr, "  --build-cache <file>\n");
+  fprintf(stderr, "               write the FASTA data (packed with -2) to cache <file> and exit\n");
   fprintf(stderr, "  -h, -?       print this help and exit\n");
-  fprintf(stderr, "One of -b, -m, or -g must be provided");
+  fprintf(stderr, "Without -b, -m or -g the FASTA data is sized from the files\n");
+  fprintf(stderr, "One of -p or -P must be provided, except with -I or -S\n");
+  fprintf(stderr, "No <fastafile> or allocation is needed with -X, -C or -A\n");
+  fprintf(stderr, "With --cache and no <fastafile>, the cache is used as it is\n");
   fprintf(stderr, "One or more <fastafile> must appear; can be text or .gz file\n");
   fprintf(stderr, "If multiple <fastafile>s, will be concatenated and searched\n");
   exit(1);
 }
 
-void
-check_thread_rtn(char *msge, int rtn) {
-  if (rtn) {
-    fprintf(stderr, "ERROR: %s (%d)\n", msge,rtn);
-    exit(1);
-  }
-}
+/* Values getopt_long() returns for options with no short form. */
+#define OPT_CACHE 256
+#define OPT_BUILD_CACHE 257
+#define OPT_HAMMING 258
+#define OPT_ENGINE 259
+#define OPT_ISA 260
 
 int
 main(int argc, char **argv)
@@ -244,9 +4959,20 @@ main(int argc, char **argv)
   char *prog_name = argv[0];
   long fasta_max_length = 0;
 
-  /* Process command-line arguments; see 'man 3 getopt'. */
+  /* Process command-line arguments; see 'man 3 getopt_long'. */
+  static struct option long_options[] = {
+	{ "cache", required_argument, NULL, OPT_CACHE },
+	{ "build-cache", required_argument, NULL, OPT_BUILD_CACHE },
+	{ "both-strands", no_argument, NULL, 'r' },
+	{ "iupac", no_argument, NULL, 'i' },
+	{ "hamming", no_argument, NULL, OPT_HAMMING },
+	{ "engine", required_argument, NULL, OPT_ENGINE },
+	{ "isa", required_argument, NULL, OPT_ISA },
+	{ NULL, 0, NULL, 0 }
+  };
   int ch;
-  while ((ch = getopt(argc, argv, "b:hm:g:p:vn:")) != -1) {
+  while ((ch = getopt_long(argc, argv, "b:hm:g:p:P:vn:s:2I:X:S:C:M:A:rik:",
+						   long_options, NULL)) != -1) {
 	switch (ch) {
 	case 'b':
 	  fasta_max_length = atol(optarg);
@@ -257,9 +4983,69 @@ main(int argc, char **argv)
 	case 'm':
 	  fasta_max_length = atol(optarg) * ONE_MEGA;
 	  break;
+	case '2':
+	  pack_sequence = 1;
+	  break;
+	case 's':
+	  stream_window = atol(optarg) * ONE_MEGA;
+	  break;
 	case 'p':
 	  pattern = optarg;
 	  break;
+	case 'P':
+	  pattern_file = optarg;
+	  break;
+	case 'I':
+	  fm_build_file = optarg;
+	  break;
+	case 'X':
+	  fm_query_file = optarg;
+	  break;
+	case 'S':
+	  serve_socket = optarg;
+	  break;
+	case 'C':
+	  client_socket = optarg;
+	  break;
+	case 'M':
+	  publish_segment = optarg;
+	  break;
+	case 'A':
+	  attach_segment = optarg;
+	  break;
+	case OPT_CACHE:
+	  cache_file = optarg;
+	  break;
+	case OPT_BUILD_CACHE:
+	  cache_file = optarg;
+	  build_cache = 1;
+	  break;
+	case 'r':
+	  both_strands = 1;
+	  break;
+	case 'i':
+	  iupac = 1;
+	  break;
+	case 'k':
+	  max_edits = atoi(optarg);
+	  break;
+	case OPT_HAMMING:
+	  hamming = 1;
+	  break;
+	case OPT_ENGINE:
+	  if (strcmp(optarg, "auto") == 0) {
+		engine = ENGINE_AUTO;
+	  } else if (strcmp(optarg, "shiftor") == 0) {
+		engine = ENGINE_SHIFT_OR;
+	  } else if (strcmp(optarg, "bndm") == 0) {
+		engine = ENGINE_BNDM;
+	  } else {
+		usage(prog_name);
+	  }
+	  break;
+	case OPT_ISA:
+	  isa = optarg;
+	  break;
 	case 'v':
 	  verbose = 1;
 	  break;
@@ -275,46 +5061,195 @@ main(int argc, char **argv)
   argc -= optind;
   argv += optind;
 
-  if (fasta_max_length == 0 || pattern == NULL) {
+  int have_pattern = pattern != NULL || pattern_file != NULL;
+  int takes_pattern = fm_build_file == NULL && serve_socket == NULL && publish_segment == NULL &&
+	!build_cache;
+  int num_modes = (fm_build_file != NULL) + (fm_query_file != NULL) + (serve_socket != NULL) +
+	(client_socket != NULL) + (publish_segment != NULL) + build_cache;
+  if ((takes_pattern ? !have_pattern || (pattern && pattern_file) : have_pattern) ||
+	  num_threads < 1 || (pack_sequence && (stream_window > 0 || pattern_file)) ||
+	  ((num_modes > 0 || attach_segment) && stream_window > 0) ||
+	  ((fm_build_file || fm_query_file || client_socket || publish_segment ||
+		attach_segment) && pack_sequence) ||
+	  (attach_segment && (fm_query_file || client_socket || publish_segment || argc > 0)) ||
+	  (both_strands && (!takes_pattern || pack_sequence)) ||
+	  (iupac && (!takes_pattern || client_socket)) ||
+	  max_edits < 0 || (hamming && max_edits == 0) ||
+	  (engine != ENGINE_AUTO && (pattern_file || both_strands || max_edits > 0 ||
+								 client_socket || fm_query_file)) ||
+	  (max_edits > 0 && (!takes_pattern || client_socket || fm_query_file ||
+						 (pack_sequence && !hamming))) ||
+	  (cache_file && (stream_window > 0 || attach_segment || fm_query_file || client_socket)) ||
+	  (build_cache && argc == 0) ||
+	  num_modes > 1) {
 	usage(prog_name);
   }
+  cpu_detect(isa);
+  query_options_t options = {
+	.iupac = iupac, .max_edits = max_edits, .hamming = hamming, .engine = engine,
+	.locate = verbose
+  };
 
-  /* Create FASTA structure with the given length. */
-  fasta = fasta_create(fasta_max_length);
+  char **patterns = NULL;
+  int num_patterns = 0;
+  if (pattern_file) {
+	patterns = read_patterns(pattern_file, &num_patterns);
+  }
 
-  /* For each <fastafile> argument, read its data into the FASTA structure. */
-  for (int idx = 0;  idx < argc;  idx++) {
-	fasta_read_file(argv[idx], fasta);
+  /* With -r, search for the reverse complements too. */
+  char **searched = patterns;
+  int num_searched = num_patterns;
+  int *reverse = NULL;
+  if (both_strands) {
+	int num_given = pattern_file ? num_patterns : 1;
+	reverse = malloc(num_given * sizeof(int));
+	searched = strand_patterns(pattern_file ? patterns : &pattern, num_given,
+							   &num_searched, reverse);
   }
+  search_totals_t totals = { 0, 0, calloc(num_searched + 1, sizeof(long)) };
 
-  // parallel stuff
-  pthread_t threads[num_threads];
+  if (fm_query_file) {
+	/* Answer straight from the index; no FASTA data needed. */
+	fm_index_t *fm = fm_load(fm_query_file);
+	printf("SEARCHING %s\n", fm_query_file);
+	double start_time = now();
+	if (num_searched > 0) {
+	  for (int i = 0;  i < num_searched;  i++) {
+		totals.pattern_counts[i] = fm_search(fm, searched[i], &options);
+		totals.match_count += totals.pattern_counts[i];
+	  }
+	} else {
+	  totals.match_count = fm_search(fm, pattern, &options);
+	}
+	printf("    TOOK %5.3f seconds\n", now() - start_time);
+	report_matches(patterns, num_patterns, reverse, &totals);
+	fm_destroy(fm);
+	exit(0);
+  }
 
-  int rtn = pthread_mutex_init(&shared_counter_mutex, NULL);
-  check_thread_rtn("mutex init", rtn);
-  
-  chunk_size = fasta->cur_length / num_threads;
-  void *match_ptr = fasta->sequence;
+  if (client_socket) {
+	/* Let the server search; a single pattern is a batch of one. */
+	printf("SEARCHING %s\n", client_socket);
+	double search_time = num_searched > 0 ?
+	  query_server(client_socket, searched, num_searched, &totals) :
+	  query_server(client_socket, &pattern, 1, &totals);
+	printf("    TOOK %5.3f seconds\n", search_time);
+	printf("   TRIED %e matches\n", (double)totals.trial_count);
+	report_matches(patterns, num_patterns, reverse, &totals);
+	exit(0);
+  }
 
-  printf("MATCHING ...\n");
-  double start_time = now();
-  for (int i = 0;  i < num_threads;  ++i) {
-	rtn = pthread_create(&threads[i], NULL, parallel_match, match_ptr);
-	check_thread_rtn("create", rtn);
-    match_ptr += chunk_size;
+  query_t *query = NULL;
+  search_context_t *context = NULL;
+  if (have_pattern) {
+	if (num_searched > 1 || pattern_file) {
+	  query = query_create(NULL, searched, num_searched, &options);
+	} else {
+	  query = query_create(pattern, NULL, 0, &options);
+	}
+	if (both_strands) {
+	  query->num_forward = pattern_file ? num_patterns : 1;
+	}
+	if (verbose) {
+	  printf("Using %s match kernel\n", query->kernel_name);
+	}
+  }
+  if (have_pattern || serve_socket) {
+	context = search_context_create(num_threads);
+  }
+
+  if (stream_window > 0) {
+	/* Loading and matching overlap, so report them together. */
+	printf("STREAMING ...\n");
+	double start_time = now();
+	stream_search(context, query, argc, argv, &totals);
+	double stream_time = now() - start_time;
+	printf("    TOOK %5.3f seconds\n", stream_time);
+	printf("    LOAD %5.3f seconds (%5.3f GB/s)\n",
+		   stream_time, stream_time > 0 ? load_bytes / stream_time / ONE_GIGA : 0.0);
+	printf("   TRIED %e matches\n", (double)totals.trial_count);
+	report_matches(patterns, num_patterns, reverse, &totals);
+	exit(0);
+  }
+
+  fasta_t *fasta;
+  segment_record_t records[argc > 0 ? argc : 1];
+  double load_start = now();
+  if (attach_segment) {
+	fasta = segment_attach(attach_segment);
+  } else if (cache_file && !build_cache &&
+			 (fasta = cache_attach(cache_file, argc, argv, pack_sequence, records)) != NULL) {
+  } else if (cache_file && argc == 0) {
+	fprintf(stderr, "Can't use cache '%s' and no <fastafile> to rebuild it from\n", cache_file);
+	exit(1);
+  } else {
+	/* Create FASTA structure with the given length, or else big enough for
+	 * the files by the look of them.
+	 */
+	if (fasta_max_length == 0) {
+	  for (int idx = 0;  idx < argc;  idx++) {
+		fasta_max_length += fasta_size_hint(argv[idx]);
+	  }
+	}
+	fasta = fasta_create(fasta_max_length);
+
+	/* For each <fastafile> argument, read its data into the FASTA structure. */
+	for (int idx = 0;  idx < argc;  idx++) {
+	  memset(&records[idx], 0, sizeof(segment_record_t));
+	  strncpy(records[idx].name, argv[idx], sizeof(records[idx].name) - 1);
+	  records[idx].start = fasta->cur_length;
+	  fasta_read_file(argv[idx], fasta);
+	  records[idx].length = fasta->cur_length - records[idx].start;
+	}
+	contig_finish(&fasta->contigs, fasta->cur_length);
+	if (pack_sequence) {
+	  fasta_pack(fasta);
+	} else {
+	  fasta_trim(fasta);
+	}
+	if (cache_file) {
+	  cache_write(fasta, records, argc, cache_file);
+	}
+  }
+  double load_time = now() - load_start;
+
+  if (build_cache) {
+	fasta_destroy(fasta);
+	exit(0);
   }
 
-  for (int i=0; i < num_threads; ++i){
-      rtn = pthread_join(threads[i], NULL);
-      check_thread_rtn("join", rtn);
+  if (publish_segment) {
+	segment_publish(fasta, records, argc, publish_segment);
+	fasta_destroy(fasta);
+	exit(0);
   }
+
+  if (fm_build_file) {
+	fm_build(fasta, fm_build_file);
+	fasta_destroy(fasta);
+	exit(0);
+  }
+
+  if (serve_socket) {
+	serve(context, fasta, serve_socket, &options);
+  }
+
+  // parallel stuff
+  printf("MATCHING ...\n");
+  double start_time = now();
+  search_job_t *job = search_submit(context, query, fasta, 0, fasta->cur_length, 0);
+  search_wait(context, job);
+  search_collect(job, &totals);
   
   printf("    TOOK %5.3f seconds\n", now() - start_time);
-  printf("   TRIED %e matches\n", (double)trial_count);
-  printf(" PATTERN %s\n", pattern);
-  printf("   MATCH %ld time%s\n", match_count, match_count == 1 ? "" : "s");
+  printf("    LOAD %5.3f seconds (%5.3f GB/s)\n",
+		 load_time, load_time > 0 ? load_bytes / load_time / ONE_GIGA : 0.0);
+  printf("   TRIED %e matches\n", (double)totals.trial_count);
+  report_matches(patterns, num_patterns, reverse, &totals);
   
   /* Clean up and be done. */
+  search_context_destroy(context);
+  query_destroy(query);
   fasta_destroy(fasta);
   exit(0);
 }